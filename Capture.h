@@ -0,0 +1,28 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+
+//Layout of a traffic capture written by the server's --capture option and read back by the replay tool
+//
+//A capture starts with CAPTURE_MAGIC, followed by records in the order the server saw them. Each record is a
+// CaptureRecord header followed by length bytes of data (only DATA records carry data). All fields are in the byte
+// order of the machine that wrote the capture.
+
+const char CAPTURE_MAGIC[8] = {'I', 'R', 'C', 'C', 'A', 'P', '0', '1'};
+
+enum CaptureRecordType {
+	CAPTURE_CONNECT = 1,	//A client connected
+	CAPTURE_DATA = 2,		//Bytes received from a client in one read()
+	CAPTURE_CLOSE = 3,		//A client closed its connection
+	CAPTURE_DROPPED = 4		//The capture fell behind, connection holds the number of records lost since the last one
+};
+
+struct CaptureRecord {
+	uint64_t timestamp;		//Microseconds since the capture started
+	uint32_t connection;	//Connection number, assigned in the order clients connected
+	uint16_t type;			//A CaptureRecordType
+	uint16_t length;		//Bytes of data following this header
+};
+
+#endif
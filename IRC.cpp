@@ -1,38 +1,808 @@
 #include <vector>
+#include <map>
+#include <deque>
+#include <unordered_map>
+#include <set>
+#include <string>
+#include <algorithm>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
 #include <arpa/inet.h>
 #include <strings.h>
 #include <regex>
 #include <getopt.h>
+#include <time.h>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <signal.h>
+#include "Capture.h"
 
 //Max values
 const int MAX_NAME_LENGTH = 21;
-const int MAX_BUFFER_LENGTH = 1024;
+const int MAX_MESSAGE_LENGTH = 512;
+const int MAX_PRIVMSG_TARGETS = 64;
+const int MAX_TARGET_LIST_LENGTH = MAX_PRIVMSG_TARGETS * MAX_NAME_LENGTH - 1;	//64 names of up to 20 chars separated by commas
+const int MAX_BUFFER_LENGTH = 2048;	//Large enough for "PRIVMSG <full target list> <512 character message>\n"
+const int DEFAULT_SEARCH_LIMIT = 100;	//Results returned by a LIST/WHO pattern search when no limit is given
+const int MAX_SEARCH_LIMIT = 1000;
+const int OUTPUT_CHUNK_LENGTH = 16384;	//Most bytes of queued output written to one client per pass of the event loop
+const size_t DEFAULT_MAX_OUTPUT = 1 << 22;	//Bytes of queued output a client may fall behind by, see --max-output
+const size_t CAPTURE_RING_LENGTH = 1 << 22;	//Bytes of traffic capture the event loop may get ahead of the capture writer
+const size_t LOG_RING_LENGTH = 1 << 20;		//Bytes of event log the event loop may get ahead of the log writer
+const int LOG_LINE_LENGTH = 256;
+
+//Sampled tracing (build with -DIRC_TRACING, enable with --trace=<file>)...on one unit of work in every traceSampleRate
+// (a pass of the event loop, or a chunk moved by a writer thread) each phase records a span into a ring owned by the
+// thread running it, and the spans held by every ring are written out as Chrome trace JSON on SIGUSR1 or TRACE
+#ifdef IRC_TRACING
+const size_t TRACE_RING_SPANS = 1 << 14;	//Most recent spans kept per thread
+const int DEFAULT_TRACE_SAMPLE_RATE = 16;
+
+struct TraceSpan {
+	const char* name;	//A string literal
+	int fd;				//Client the span worked on, or -1
+	uint64_t start;		//Nanoseconds on CLOCK_MONOTONIC
+	uint64_t end;
+};
+
+//Spans recorded by one thread...only that thread writes to it, dumpTrace() reads it from the event loop
+struct TraceRing {
+	struct TraceSpan spans[TRACE_RING_SPANS];
+	std::atomic<size_t> recorded;	//Spans ever recorded, span i is held in spans[i % TRACE_RING_SPANS]
+	int tid;
+	const char* threadName;
+};
+
+const char* traceFileName = NULL;
+int traceSampleRate = DEFAULT_TRACE_SAMPLE_RATE;
+volatile sig_atomic_t traceDumpRequested = 0;	//Set by SIGUSR1, the event loop writes the trace on its next pass
+std::mutex traceRingsLock;
+std::vector<struct TraceRing*> traceRings;	//Every thread's ring, kept for as long as the server runs
+thread_local struct TraceRing* traceRing = NULL;
+thread_local const char* traceThreadName = "thread";
+thread_local bool traceSampled = false;
+thread_local unsigned long traceUnits = 0;
+
+//This function returns the current time on CLOCK_MONOTONIC in nanoseconds
+uint64_t traceNow() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+//This function decides whether the calling thread records spans for its next unit of work
+void traceSample() {
+	traceSampled = traceFileName != NULL && ++ traceUnits % traceSampleRate == 0;
+}
+
+//This function records a span that started at start and ends now into the calling thread's ring, creating the ring
+// the first time the thread records anything
+void traceRecord(const char* name, int fd, uint64_t start) {
+	if(traceRing == NULL) {
+		traceRing = new TraceRing;
+		traceRing->recorded.store(0);
+		traceRing->threadName = traceThreadName;
+		std::lock_guard<std::mutex> guard(traceRingsLock);
+		traceRing->tid = traceRings.size() + 1;
+		traceRings.push_back(traceRing);
+	}
+
+	size_t recorded = traceRing->recorded.load(std::memory_order_relaxed);
+	struct TraceSpan& span = traceRing->spans[recorded % TRACE_RING_SPANS];
+	span.name = name;
+	span.fd = fd;
+	span.start = start;
+	span.end = traceNow();
+	traceRing->recorded.store(recorded + 1, std::memory_order_release);
+}
+
+//Records a span covering the rest of the enclosing block, given a NULL name when the current unit of work is not
+// sampled (see TRACE_SPAN)
+struct TraceScope {
+	const char* name;
+	int fd;
+	uint64_t start;
+
+	TraceScope(const char* spanName, int spanFD) : name(spanName), fd(spanFD) {
+		if(name != NULL) {
+			start = traceNow();
+		}
+	}
+	~TraceScope() {
+		if(name != NULL) {
+			traceRecord(name, fd, start);
+		}
+	}
+};
+
+//This function writes every span still held by each thread's ring to traceFileName as Chrome trace JSON (loadable in
+// chrome://tracing or Perfetto), returning false if the file could not be written
+bool dumpTrace() {
+	FILE* file = fopen(traceFileName, "w");
+	if(file == NULL) {
+		return false;
+	}
+
+	fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	const char* separator = "";
+	std::lock_guard<std::mutex> guard(traceRingsLock);
+	for(int i = 0; i < traceRings.size(); i ++) {
+		struct TraceRing* ring = traceRings[i];
+		fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", separator, (int) getpid(), ring->tid, ring->threadName);
+		separator = ",\n";
+
+		//Copy the spans out first, other threads keep recording while we do...any span that may have been overwritten
+		// before the copy finished is left out
+		size_t recorded = ring->recorded.load(std::memory_order_acquire);
+		size_t oldest = recorded > TRACE_RING_SPANS ? recorded - TRACE_RING_SPANS : 0;
+		std::vector<struct TraceSpan> spans;
+		for(size_t j = oldest; j < recorded; j ++) {
+			spans.push_back(ring->spans[j % TRACE_RING_SPANS]);
+		}
+		size_t recordedAfter = ring->recorded.load(std::memory_order_acquire);
+		size_t firstIntact = recordedAfter >= TRACE_RING_SPANS ? recordedAfter - TRACE_RING_SPANS + 1 : 0;
+
+		for(size_t j = std::max(oldest, firstIntact); j < recorded; j ++) {
+			struct TraceSpan& span = spans[j - oldest];
+			fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f", span.name, (int) getpid(), ring->tid,
+				span.start / 1000.0, (span.end - span.start) / 1000.0);
+			if(span.fd >= 0) {
+				fprintf(file, ",\"args\":{\"fd\":%d}", span.fd);
+			}
+			fprintf(file, "}");
+		}
+	}
+	fprintf(file, "\n]}\n");
+	return fclose(file) == 0;
+}
+
+//This function returns the span name recorded for handling command, which must outlive the span
+const char* traceCommandName(const char* command) {
+	static const char* commands[] = {"USER", "LIST", "WHO", "JOIN", "PART", "OPERATOR", "KICK", "PRIVMSG", "STATS", "TRACE", "QUIT"};
+	for(int i = 0; i < sizeof(commands) / sizeof(commands[0]); i ++) {
+		if(strcmp(command, commands[i]) == 0) {
+			return commands[i];
+		}
+	}
+	return "invalid command";
+}
+
+//This function handles SIGUSR1 by asking the event loop to write the trace
+void requestTraceDump(int) {
+	traceDumpRequested = 1;
+}
+
+#define TRACE_CONCAT_LINE(prefix, line) prefix##line
+#define TRACE_SCOPE_NAME(prefix, line) TRACE_CONCAT_LINE(prefix, line)
+//The span name is only worked out once the unit of work is known to be sampled, so an unsampled span costs one check
+#define TRACE_SPAN(name, fd) struct TraceScope TRACE_SCOPE_NAME(traceScope, __LINE__)(traceSampled ? (name) : NULL, fd)
+#define TRACE_SAMPLE() traceSample()
+#define TRACE_THREAD(name) (traceThreadName = (name))
+#else
+#define TRACE_SPAN(name, fd)
+#define TRACE_SAMPLE()
+#define TRACE_THREAD(name)
+#endif
+
+//A lock-free byte ring with a single producer (the event loop) and a single consumer (a background thread)...head and
+// tail count every byte ever written and read, so head - tail is the number of bytes waiting...a consumer that finds
+// the ring empty sleeps on wakeup until the producer writes to it again
+struct ByteRing {
+	char* data;
+	size_t capacity;	//A power of two
+	std::atomic<size_t> head;
+	std::atomic<size_t> tail;
+	std::atomic<bool> consumerWaiting;
+	std::mutex wakeLock;
+	std::condition_variable wakeup;
+};
+
+//This function allocates the storage of ring, capacity must be a power of two
+void initRing(struct ByteRing& ring, size_t capacity) {
+	ring.data = (char*) malloc(capacity);
+	ring.capacity = capacity;
+	ring.head.store(0);
+	ring.tail.store(0);
+	ring.consumerWaiting.store(false);
+}
+
+//This function copies the two pieces first and second into ring as one unit, returning false without writing anything
+// if they do not both fit...it never waits on the consumer
+bool ringPush(struct ByteRing& ring, const void* first, size_t firstLen, const void* second, size_t secondLen) {
+	size_t head = ring.head.load(std::memory_order_relaxed);
+	size_t tail = ring.tail.load(std::memory_order_acquire);
+	if(ring.capacity - (head - tail) < firstLen + secondLen) {
+		return false;
+	}
+
+	const char* pieces[2] = {(const char*) first, (const char*) second};
+	size_t pieceLens[2] = {firstLen, secondLen};
+	for(int i = 0; i < 2; i ++) {
+		for(size_t copied = 0; copied < pieceLens[i]; ) {
+			size_t offset = head & (ring.capacity - 1);
+			size_t chunk = std::min(pieceLens[i] - copied, ring.capacity - offset);
+			memcpy(ring.data + offset, pieces[i] + copied, chunk);
+			copied += chunk;
+			head += chunk;
+		}
+	}
+
+	ring.head.store(head, std::memory_order_release);
+
+	//Only take the lock when the consumer has gone to sleep on an empty ring, which pairs with ringWait()
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if(ring.consumerWaiting.load(std::memory_order_relaxed)) {
+		std::lock_guard<std::mutex> guard(ring.wakeLock);
+		ring.wakeup.notify_one();
+	}
+	return true;
+}
+
+//This function moves up to maxLen waiting bytes out of ring into out, returning how many were moved
+size_t ringPop(struct ByteRing& ring, char* out, size_t maxLen) {
+	size_t tail = ring.tail.load(std::memory_order_relaxed);
+	size_t head = ring.head.load(std::memory_order_acquire);
+	size_t total = std::min(head - tail, maxLen);
+
+	for(size_t copied = 0; copied < total; ) {
+		size_t offset = tail & (ring.capacity - 1);
+		size_t chunk = std::min(total - copied, ring.capacity - offset);
+		memcpy(out + copied, ring.data + offset, chunk);
+		copied += chunk;
+		tail += chunk;
+	}
+
+	ring.tail.store(tail, std::memory_order_release);
+	return total;
+}
+
+//This function blocks the consumer of ring until there are bytes waiting in it
+void ringWait(struct ByteRing& ring) {
+	std::unique_lock<std::mutex> lock(ring.wakeLock);
+	ring.consumerWaiting.store(true);
+	while(ring.head.load() == ring.tail.load(std::memory_order_relaxed)) {
+		ring.wakeup.wait(lock);
+	}
+	ring.consumerWaiting.store(false);
+}
+
+//This function waits (for up to about a second) until the consumer of ring has written out everything in it...the
+// consumer only goes back to waiting once it has flushed its file
+void ringDrain(struct ByteRing& ring) {
+	for(int i = 0; i < 1000; i ++) {
+		if(ring.consumerWaiting.load() && ring.head.load() == ring.tail.load()) {
+			return;
+		}
+		usleep(1000);
+	}
+}
+
+//This function runs on a background thread for as long as the server runs, moving everything written to ring into file
+void ringWriter(struct ByteRing* ring, FILE* file) {
+	char chunk[65536];
+	TRACE_THREAD("writer");
+#ifdef IRC_TRACING
+	//Leave SIGUSR1 to the event loop, so that it interrupts select()
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+#endif
+	for( ; ; ) {
+		TRACE_SAMPLE();
+		size_t chunkLen = ringPop(*ring, chunk, sizeof(chunk));
+		if(chunkLen > 0) {
+			TRACE_SPAN("write", -1);
+			fwrite(chunk, 1, chunkLen, file);
+		}
+		else {	//Nothing waiting, push what we have to disk and sleep until the event loop writes more
+			fflush(file);
+			ringWait(*ring);
+		}
+	}
+}
+
+//Event log (--log=<file>)...the event loop formats one line per event into logRing and a background thread writes them
+// to logFile, so handlers never wait on disk. Events that do not fit in the ring are dropped and counted.
+FILE* logFile = NULL;
+struct ByteRing& logRing = *new ByteRing;	//Never destroyed, the writer may still be waiting on it when the server exits
+unsigned long logDropped = 0;	//Events dropped since the last DROPPED event made it into the ring
+
+//This function adds an event to the event log as "<unix time> <event> <details>\n", with the details formatted like
+// printf()...it does nothing when the server was started without --log
+void logEvent(const char* event, const char* format, ...) {
+	if(logFile == NULL) {
+		return;
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	//Let the reader of the log know where events went missing before recording anything new
+	char line[LOG_LINE_LENGTH];
+	int lineLen;
+	if(logDropped > 0) {
+		lineLen = snprintf(line, sizeof(line), "%ld.%06ld DROPPED count=%lu\n", (long) now.tv_sec, now.tv_nsec / 1000, logDropped);
+		if(ringPush(logRing, line, lineLen, NULL, 0)) {
+			logDropped = 0;
+		}
+	}
+
+	lineLen = snprintf(line, sizeof(line), "%ld.%06ld %s ", (long) now.tv_sec, now.tv_nsec / 1000, event);
+	va_list args;
+	va_start(args, format);
+	lineLen += vsnprintf(line + lineLen, sizeof(line) - lineLen - 1, format, args);
+	va_end(args);
+	lineLen = std::min(lineLen, (int) sizeof(line) - 2);	//Cut off overly long details but keep the line ending
+	line[lineLen ++] = '\n';
+
+	if(logDropped > 0 || !ringPush(logRing, line, lineLen, NULL, 0)) {
+		logDropped ++;
+	}
+}
+
+//This function opens fileName for appending as the event log and starts the log writer thread
+void startLog(const char* fileName) {
+	if((logFile = fopen(fileName, "a")) == NULL) {
+		perror("fopen() error");
+		exit(-1);
+	}
+
+	initRing(logRing, LOG_RING_LENGTH);
+	std::thread(ringWriter, &logRing, logFile).detach();
+}
+
+//This function reports a fatal error the way perror() does, records it in the event log, and exits once the log
+// writer has written out everything it was given
+void exitWithError(const char* message) {
+	int error = errno;
+	perror(message);
+	logEvent("ERROR", "reason=fatal message=\"%s: %s\"", message, strerror(error));
+
+	if(logFile != NULL) {
+		ringDrain(logRing);
+		fflush(logFile);
+	}
+	exit(-1);
+}
+
+//Traffic capture (--capture=<file>)...the event loop copies every client's inbound bytes into captureRing and a
+// background thread writes them to captureFile, records that do not fit in the ring are dropped and counted
+FILE* captureFile = NULL;
+struct ByteRing& captureRing = *new ByteRing;	//Never destroyed, see logRing
+struct timespec captureStart;
+std::map<int, uint32_t> captureConnections;	//Connection number of each client FD
+uint32_t nextCaptureConnection = 0;
+uint32_t captureDropped = 0;	//Records dropped since the last CAPTURE_DROPPED record made it into the ring
+
+//This function records an event of the given type for the client on sockfd, with length bytes of data
+void captureEvent(int sockfd, CaptureRecordType type, const char* data, int length) {
+	if(captureFile == NULL) {
+		return;
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	struct CaptureRecord record;
+	record.timestamp = (now.tv_sec - captureStart.tv_sec) * 1000000LL + (now.tv_nsec - captureStart.tv_nsec) / 1000;
+	if(type == CAPTURE_CONNECT) {
+		captureConnections[sockfd] = nextCaptureConnection ++;
+	}
+	else if(captureConnections.count(sockfd) == 0) {	//Not a connection the capture has seen open
+		return;
+	}
+	record.connection = captureConnections[sockfd];
+	record.type = type;
+	record.length = length;
+
+	//Let the reader of the capture know where records went missing before recording anything new
+	if(captureDropped > 0) {
+		struct CaptureRecord dropped = record;
+		dropped.connection = captureDropped;
+		dropped.type = CAPTURE_DROPPED;
+		dropped.length = 0;
+		if(ringPush(captureRing, &dropped, sizeof(dropped), NULL, 0)) {
+			captureDropped = 0;
+		}
+	}
+
+	if(captureDropped > 0 || !ringPush(captureRing, &record, sizeof(record), data, length)) {
+		captureDropped ++;
+	}
+
+	if(type == CAPTURE_CLOSE) {
+		captureConnections.erase(sockfd);
+	}
+}
+
+//This function opens fileName as the traffic capture and starts the capture thread
+void startCapture(const char* fileName) {
+	if((captureFile = fopen(fileName, "wb")) == NULL) {
+		exitWithError("fopen() error");
+	}
+	fwrite(CAPTURE_MAGIC, 1, sizeof(CAPTURE_MAGIC), captureFile);
+
+	initRing(captureRing, CAPTURE_RING_LENGTH);
+	clock_gettime(CLOCK_MONOTONIC, &captureStart);
+	std::thread(ringWriter, &captureRing, captureFile).detach();
+}
 
 //User and Channel structs to hold our data
 struct User {
-	char userName[MAX_NAME_LENGTH];
-	int userNameLength;	//Easier to send messages to clients that involve the user's name
+	int nameID;	//Interned nickname, see internName()
 	bool isOperator;
 	int userFD;
+	unsigned long joinSerial;	//In usersInChannel, when the user joined the channel (members are kept in this order)
 };
 
+//Join serial of the most recent JOIN, serials are never reused
+unsigned long lastJoinSerial = 0;
+
 struct Channel {
-	char channelName[MAX_NAME_LENGTH];
-	int channelNameLength;	//Easier to send messages to clients that involve the channel's name
+	int nameID;	//Interned channel name, see internName()
 	std::vector<User> usersInChannel;
+	size_t memory;	//Bytes attributed to the channel, see chargeChannel()
+};
+
+//Interned nicknames and channel names...each distinct name is stored once and has a stable ID and hash for as long as
+// a user or channel holds it, so names are compared as integers and only turned back into text when formatting output
+struct InternedName {
+	char text[MAX_NAME_LENGTH];
+	int length;
+	uint32_t hash;
+	int references;	//Users and channels holding the name, its ID is reused once this drops to 0
 };
 
+std::vector<InternedName> internedNames;
+std::unordered_multimap<uint32_t, int> internIDsByHash;
+std::vector<int> freeInternIDs;
+
+//This function returns the FNV-1a hash of the length characters of name
+uint32_t hashName(const char* name, int length) {
+	uint32_t hash = 2166136261u;
+	for(int i = 0; i < length; i ++) {
+		hash = (hash ^ (unsigned char) name[i]) * 16777619u;
+	}
+	return hash;
+}
+
+//This function returns the ID of name, or -1 if no user or channel holds that name
+int lookupName(const char* name) {
+	int length = strlen(name);
+	std::pair<std::unordered_multimap<uint32_t, int>::iterator, std::unordered_multimap<uint32_t, int>::iterator> candidates;
+	candidates = internIDsByHash.equal_range(hashName(name, length));
+	for(std::unordered_multimap<uint32_t, int>::iterator it = candidates.first; it != candidates.second; it ++) {
+		if(internedNames[it->second].length == length && memcmp(internedNames[it->second].text, name, length) == 0) {
+			return it->second;
+		}
+	}
+	return -1;
+}
+
+//This function returns the ID of name, interning it first if nothing holds it yet, and adds a reference to it...the
+// caller must pass a name of at most MAX_NAME_LENGTH - 1 characters and call releaseName() when done with it
+int internName(const char* name) {
+	int id = lookupName(name);
+	if(id == -1) {
+		if(!freeInternIDs.empty()) {
+			id = freeInternIDs.back();
+			freeInternIDs.pop_back();
+		}
+		else {
+			id = internedNames.size();
+			internedNames.push_back(InternedName());
+		}
+
+		struct InternedName& interned = internedNames[id];
+		strcpy(interned.text, name);
+		interned.length = strlen(name);
+		interned.hash = hashName(name, interned.length);
+		interned.references = 0;
+		internIDsByHash.insert(std::make_pair(interned.hash, id));
+	}
+
+	internedNames[id].references ++;
+	return id;
+}
+
+//This function drops a reference to the name with the given ID, freeing the ID once nothing holds the name
+void releaseName(int id) {
+	if(-- internedNames[id].references > 0) {
+		return;
+	}
+
+	std::pair<std::unordered_multimap<uint32_t, int>::iterator, std::unordered_multimap<uint32_t, int>::iterator> candidates;
+	candidates = internIDsByHash.equal_range(internedNames[id].hash);
+	for(std::unordered_multimap<uint32_t, int>::iterator it = candidates.first; it != candidates.second; it ++) {
+		if(it->second == id) {
+			internIDsByHash.erase(it);
+			break;
+		}
+	}
+	freeInternIDs.push_back(id);
+}
+
+//These functions materialize the name with the given ID for output
+const char* nameText(int id) {
+	return internedNames[id].text;
+}
+
+int nameLength(int id) {
+	return internedNames[id].length;
+}
+
 //Server information
 char password[MAX_NAME_LENGTH];
 std::vector<User> allUsers;
 std::vector<Channel> allChannels;
 std::vector<int> allClients;
 
+//Ordered indexes of every channel name and nickname, used to answer LIST and WHO pattern searches without
+// walking allChannels or allUsers
+std::set<std::string> channelIndex;
+std::set<std::string> userIndex;
+
+//Position in allChannels of every channel each user (by FD) is a member of, so that leaving a channel or disconnecting
+// only touches the user's own channels...positions only change when removeEmptyChannels() moves a channel, which
+// updates these to match
+std::map<int, std::vector<int> > channelsOfUser;
+
+//Users whose connection ended during the current pass of the event loop, removed together by removeInstances()
+std::vector<int> disconnectedFDs;
+
+//Channels whose last member left during the current pass of the event loop, torn down by removeEmptyChannels()
+std::vector<int> emptiedChannels;
+
+//A response waiting to be sent to a client...either plain text, or a LIST whose lines are generated from a cursor
+// one chunk at a time so that a large listing is spread across passes of the event loop
+enum ResponseKind { TEXT_RESPONSE, CHANNEL_LISTING, MEMBER_LISTING };
+
+struct PendingResponse {
+	ResponseKind kind;
+	std::string text;		//Text to send for a TEXT_RESPONSE
+	std::string cursor;		//Last channel name sent by a CHANNEL_LISTING
+	int channel;			//Position in allChannels of the channel whose members a MEMBER_LISTING sends, -1 once it is gone
+	unsigned long memberCursor;	//Join serial of the last member sent by a MEMBER_LISTING, 0 before the first
+};
+
+//Output that a client's socket has not accepted yet, followed by the responses queued behind it
+struct ClientOutput {
+	std::string buffer;
+	std::deque<PendingResponse> responses;
+	size_t queuedBytes;	//Bytes of text in buffer and responses, charged to the client's connection
+	bool overflowed;	//Text was turned away for going over maxOutput, the client is disconnected on the next pass
+};
+
+//Clients with output still waiting to be sent, these are watched for writability by select()
+std::map<int, ClientOutput> clientOutputs;
+
+//Memory accounting...an estimate of the memory held on behalf of each connection and each channel, kept up to date as
+// data is added and removed so that totals can be reported and limits checked without walking any structure
+const size_t INDEX_ENTRY_BYTES = 64;	//Rough cost of one node of a std::set or std::map, on top of its contents
+const size_t CONNECTION_BYTES = sizeof(int) + INDEX_ENTRY_BYTES;	//allClients slot and channelsOfUser entry
+const size_t USER_BYTES = sizeof(User) + sizeof(InternedName) + INDEX_ENTRY_BYTES;	//allUsers entry, nickname and userIndex entry
+const size_t MEMBERSHIP_BYTES = sizeof(int);	//channelsOfUser entry for each channel a user is in
+const size_t CHANNEL_BYTES = sizeof(Channel) + sizeof(InternedName) + INDEX_ENTRY_BYTES;	//allChannels entry, name and channelIndex entry
+const size_t MEMBER_BYTES = sizeof(User);	//usersInChannel entry for each member of a channel
+
+std::map<int, size_t> connectionMemory;	//Bytes attributed to each connection, by FD
+size_t connectionMemoryInUse = 0;
+size_t channelMemoryInUse = 0;
+
+//Limits, 0 for none
+size_t memoryLimit = 0;			//Once connections and channels use this many bytes, new connections and JOINs are refused
+int maxChannelsPerUser = 0;
+int maxChannelMembers = 0;
+size_t maxOutput = DEFAULT_MAX_OUTPUT;	//Most output that may wait for one client before it is disconnected
+
+//This function adds bytes (which may be negative) to the memory attributed to the connection on sockfd
+void chargeConnection(int sockfd, long bytes) {
+	connectionMemory[sockfd] += bytes;
+	connectionMemoryInUse += bytes;
+}
+
+//This function adds bytes (which may be negative) to the memory attributed to the channel at position channel in
+// allChannels
+void chargeChannel(int channel, long bytes) {
+	allChannels[channel].memory += bytes;
+	channelMemoryInUse += bytes;
+}
+
+//This function returns true if connections and channels have reached the memory limit
+bool overMemoryLimit() {
+	return memoryLimit != 0 && connectionMemoryInUse + channelMemoryInUse >= memoryLimit;
+}
+
+//This function returns the message turning away the user on sockfd from a channel that has memberCount members, or
+// NULL if the user may join it
+const char* joinRefusal(int sockfd, int memberCount) {
+	if(overMemoryLimit()) {
+		return "The server is full, try again later.\n";
+	}
+	if(maxChannelsPerUser != 0 && channelsOfUser[sockfd].size() >= maxChannelsPerUser) {
+		return "You are already in the maximum number of channels.\n";
+	}
+	if(maxChannelMembers != 0 && memberCount >= maxChannelMembers) {
+		return "That channel is full.\n";
+	}
+	return NULL;
+}
+
+//This function drops everything queued for the client on sockfd
+void dropClientOutput(int sockfd) {
+	std::map<int, ClientOutput>::iterator it = clientOutputs.find(sockfd);
+	if(it != clientOutputs.end()) {
+		chargeConnection(sockfd, -(long) it->second.queuedBytes);
+		clientOutputs.erase(it);
+	}
+}
+
+//This function drops everything queued for the client on sockfd and releases all memory attributed to its connection,
+// once the connection has ended...every connection the server closes passes through here, so its close is captured here
+void forgetConnection(int sockfd) {
+	captureEvent(sockfd, CAPTURE_CLOSE, NULL, 0);
+	dropClientOutput(sockfd);
+	std::map<int, size_t>::iterator it = connectionMemory.find(sockfd);
+	if(it != connectionMemory.end()) {
+		connectionMemoryInUse -= it->second;
+		connectionMemory.erase(it);
+	}
+}
+
+//This function queues text for sockfd behind any output the client is already waiting on
+void queueText(int sockfd, const char* text, int textLen) {
+	ClientOutput& output = clientOutputs[sockfd];
+	if(output.overflowed || output.queuedBytes + textLen > maxOutput) {	//The client is not keeping up, stop queuing for it
+		output.overflowed = true;
+		return;
+	}
+	output.queuedBytes += textLen;
+	chargeConnection(sockfd, textLen);
+	if(output.responses.empty()) {
+		output.buffer.append(text, textLen);
+	}
+	else if(output.responses.back().kind == TEXT_RESPONSE) {
+		output.responses.back().text.append(text, textLen);
+	}
+	else {
+		struct PendingResponse response;
+		response.kind = TEXT_RESPONSE;
+		response.text.assign(text, textLen);
+		output.responses.push_back(response);
+	}
+}
+
+//This function sends the iovcnt pieces in iov to the client on sockfd without blocking...if the client already has
+// output waiting, or the socket does not take everything, the rest is queued to be flushed by the event loop
+void sendVectorToClient(int sockfd, struct iovec* iov, int iovcnt) {
+	ssize_t sent = 0;
+	if(clientOutputs.count(sockfd) == 0) {
+		struct msghdr msg;
+		bzero(&msg, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iovcnt;
+		if((sent = sendmsg(sockfd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL)) < 0) {
+			if(errno != EAGAIN && errno != EWOULDBLOCK) {	//The client is gone, its disconnect will be picked up by read()
+				return;
+			}
+			sent = 0;
+		}
+	}
+
+	for(int i = 0; i < iovcnt; i ++) {
+		if(sent >= (ssize_t) iov[i].iov_len) {
+			sent -= iov[i].iov_len;
+		}
+		else {
+			queueText(sockfd, (char*) iov[i].iov_base + sent, iov[i].iov_len - sent);
+			sent = 0;
+		}
+	}
+}
+
+//This function sends mesgLen bytes of mesg to the client on sockfd, see sendVectorToClient()
+void sendToClient(int sockfd, const char* mesg, int mesgLen) {
+	struct iovec iov = {(void*) mesg, (size_t) mesgLen};
+	sendVectorToClient(sockfd, &iov, 1);
+}
+
+//This function queues a channel or member listing for sockfd, its lines are generated as the client drains its output
+void queueListing(int sockfd, ResponseKind kind, int channel) {
+	struct PendingResponse response;
+	response.kind = kind;
+	response.channel = channel;
+	response.memberCursor = 0;
+	clientOutputs[sockfd].responses.push_back(response);
+}
+
+//This function orders a join serial against a channel member, for searching usersInChannel
+bool joinedBefore(unsigned long joinSerial, const User& member) {
+	return joinSerial < member.joinSerial;
+}
+
+//This function appends lines of listing to buffer until buffer holds a full chunk, returning true once the listing
+// has been completely generated
+bool fillListing(struct PendingResponse& listing, std::string& buffer) {
+	TRACE_SPAN(listing.kind == CHANNEL_LISTING ? "channel listing" : "member listing", -1);
+	if(listing.kind == CHANNEL_LISTING) {
+		//Resume after the last channel sent, channels created since then are picked up in order
+		std::set<std::string>::iterator it = listing.cursor.empty() ? channelIndex.begin() : channelIndex.upper_bound(listing.cursor);
+		for( ; it != channelIndex.end() && buffer.size() < OUTPUT_CHUNK_LENGTH; it ++) {
+			buffer += "* ";
+			buffer += *it;
+			buffer += "\n";
+			listing.cursor = *it;
+		}
+		return it == channelIndex.end();
+	}
+	else if(listing.channel == -1) {	//The channel was torn down before its listing finished
+		return true;
+	}
+	else {
+		//Resume after the last member sent...members stay in join order as others leave, so nobody who is still in
+		// the channel is skipped, and members who joined since then are picked up at the end
+		std::vector<User>& members = allChannels[listing.channel].usersInChannel;
+		int next = std::upper_bound(members.begin(), members.end(), listing.memberCursor, joinedBefore) - members.begin();
+		for( ; next < members.size() && buffer.size() < OUTPUT_CHUNK_LENGTH; next ++) {
+			buffer += "* ";
+			buffer.append(nameText(members[next].nameID), nameLength(members[next].nameID));
+			buffer += "\n";
+			listing.memberCursor = members[next].joinSerial;
+		}
+		return next >= members.size();
+	}
+}
+
+//This function tops up sockfd's output buffer to a chunk from its queued responses and writes as much of it as the
+// socket accepts without blocking
+void flushClientOutput(int sockfd) {
+	TRACE_SPAN("flush", sockfd);
+	ClientOutput& output = clientOutputs[sockfd];
+	while(output.buffer.size() < OUTPUT_CHUNK_LENGTH && !output.responses.empty()) {
+		struct PendingResponse& response = output.responses.front();
+		if(response.kind == TEXT_RESPONSE) {
+			output.buffer += response.text;
+			output.responses.pop_front();
+		}
+		else {	//Lines generated from a listing are charged to the connection until they are sent
+			size_t generatedFrom = output.buffer.size();
+			if(fillListing(response, output.buffer)) {
+				output.responses.pop_front();
+			}
+			output.queuedBytes += output.buffer.size() - generatedFrom;
+			chargeConnection(sockfd, output.buffer.size() - generatedFrom);
+		}
+	}
+
+	ssize_t sent = send(sockfd, output.buffer.data(), output.buffer.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+	if(sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {	//The client is gone, drop everything queued for it
+		dropClientOutput(sockfd);
+		return;
+	}
+	if(sent > 0) {
+		output.buffer.erase(0, sent);
+		output.queuedBytes -= sent;
+		chargeConnection(sockfd, -(long) sent);
+	}
+	if(output.buffer.empty() && output.responses.empty()) {
+		dropClientOutput(sockfd);
+	}
+}
+
 //This function returns the number of digits in num
 int numDigits(int num) {
 	int digits = 1;
@@ -55,132 +825,558 @@ bool userExists(int checkFD) {
 	return false;
 }
 
-//This function removes all instances of a disconnected user with the given FD
-void removeInstances(int removedFD) {
+//This function removes every user whose FD is in departingFDs (which must be sorted) from the channel at position
+// channel in allChannels, then sends each remaining member all of the departure notices in one write
+void removeFromChannel(int channel, const std::vector<int>& departingFDs) {
+	std::vector<User>& members = allChannels[channel].usersInChannel;
+	std::string notices;
+	int kept = 0;
+	for(int i = 0; i < members.size(); i ++) {
+		if(std::binary_search(departingFDs.begin(), departingFDs.end(), members[i].userFD)) {
+			notices.append(nameText(allChannels[channel].nameID), nameLength(allChannels[channel].nameID));
+			notices += "> ";
+			notices.append(nameText(members[i].nameID), nameLength(members[i].nameID));
+			notices += " has left the channel.\n";
+		}
+		else {
+			members[kept ++] = members[i];
+		}
+	}
+	chargeChannel(channel, -(long) ((members.size() - kept) * MEMBER_BYTES));
+	members.resize(kept);
+	if(members.empty()) {
+		emptiedChannels.push_back(channel);
+	}
 
-	//Remove from allUsers...we can break as soon as we find one instance since there
-	//can only be 1 user per FD
-	for(int i = 0; i < allUsers.size(); i ++) {
-		if(allUsers[i].userFD == removedFD) {
-			allUsers.erase(allUsers.begin() + i);
-			i = allUsers.size() - 1;	//Breaks out of the loop
+	if(!notices.empty()) {
+		for(int i = 0; i < members.size(); i ++) {
+			sendToClient(members[i].userFD, notices.data(), notices.size());
+		}
+	}
+}
+
+//This function removes the channel at position channel from the channel index of the user on sockfd
+void forgetChannel(int sockfd, int channel) {
+	std::vector<int>& channels = channelsOfUser[sockfd];
+	std::vector<int>::iterator it = std::find(channels.begin(), channels.end(), channel);
+	if(it != channels.end()) {
+		channels.erase(it);
+		chargeConnection(sockfd, -(long) MEMBERSHIP_BYTES);
+	}
+}
+
+//This function removes all instances of the disconnected users with the given FDs from our data and closes their
+// connections...each channel is visited once no matter how many of the users were in it, and removedFDs is cleared
+void removeInstances(std::vector<int>& removedFDs) {
+	if(removedFDs.empty()) {
+		return;
+	}
+	TRACE_SPAN("removeInstances", -1);
+	std::sort(removedFDs.begin(), removedFDs.end());
+
+	//Group the departing users by channel using their channel indexes, then update each of those channels
+	std::map<int, std::vector<int> > departuresByChannel;
+	for(int i = 0; i < removedFDs.size(); i ++) {
+		std::map<int, std::vector<int> >::iterator joined = channelsOfUser.find(removedFDs[i]);
+		if(joined != channelsOfUser.end()) {
+			for(int j = 0; j < joined->second.size(); j ++) {
+				departuresByChannel[joined->second[j]].push_back(removedFDs[i]);
+			}
+			channelsOfUser.erase(joined);
 		}
 	}
+	for(std::map<int, std::vector<int> >::iterator it = departuresByChannel.begin(); it != departuresByChannel.end(); it ++) {
+		removeFromChannel(it->first, it->second);
+	}
 
-	//For each channel, remove the user if they are there
-	//We can break in the inner loop because each channel will have at most one instance of the disconnected user
-	for(int i = 0; i < allChannels.size(); i ++) {
-		for(int j = 0; j < allChannels[i].usersInChannel.size(); j ++) {
-			if(allChannels[i].usersInChannel[j].userFD == removedFD) {
+	//Remove from allUsers in a single pass
+	int kept = 0;
+	for(int i = 0; i < allUsers.size(); i ++) {
+		if(std::binary_search(removedFDs.begin(), removedFDs.end(), allUsers[i].userFD)) {
+			userIndex.erase(nameText(allUsers[i].nameID));
+			releaseName(allUsers[i].nameID);
+		}
+		else {
+			allUsers[kept ++] = allUsers[i];
+		}
+	}
+	allUsers.resize(kept);
 
-				//Notify other members of the channel that the user has left the channel
-				int mesgLen = 25 + allChannels[i].channelNameLength + allChannels[i].usersInChannel[j].userNameLength;
-				char mesg[mesgLen];
-				strcpy(mesg, allChannels[i].channelName);
-				strcat(mesg, "> ");
-				strcat(mesg, allChannels[i].usersInChannel[j].userName);
-				strcat(mesg, " has left the channel.\n");
+	//Anything still queued for the users can no longer be delivered
+	for(int i = 0; i < removedFDs.size(); i ++) {
+		forgetConnection(removedFDs[i]);
+		close(removedFDs[i]);
+	}
+	removedFDs.clear();
+}
 
-				for(int k = 0; k < allChannels[i].usersInChannel.size(); k ++) {
+//This function tears down every channel in emptied that is still empty, releasing its name, index entry and memory...
+// the last channel in allChannels takes over each removed channel's position, so its members' channel indexes and any
+// listing of it are updated to match, and emptied is cleared
+void removeEmptyChannels(std::vector<int>& emptied) {
+	if(emptied.empty()) {
+		return;
+	}
+	TRACE_SPAN("removeEmptyChannels", -1);
+	std::sort(emptied.begin(), emptied.end());
+	emptied.erase(std::unique(emptied.begin(), emptied.end()), emptied.end());
+
+	//Work from the back, so the channel moved into a removed position is never one still waiting to be looked at
+	for(int i = emptied.size() - 1; i >= 0; i --) {
+		int channel = emptied[i];
+		if(!allChannels[channel].usersInChannel.empty()) {	//Someone joined it again later in the pass
+			continue;
+		}
 
-					if(k != j) {	//Don't send the message to the disconnecting user
-						write(allChannels[i].usersInChannel[k].userFD, mesg, mesgLen);
-					}
+		logEvent("CHANNEL_CLOSED", "channel=%s", nameText(allChannels[channel].nameID));
+		channelIndex.erase(nameText(allChannels[channel].nameID));
+		releaseName(allChannels[channel].nameID);
+		channelMemoryInUse -= allChannels[channel].memory;
+
+		int last = allChannels.size() - 1;
+		for(std::map<int, ClientOutput>::iterator it = clientOutputs.begin(); it != clientOutputs.end(); it ++) {
+			std::deque<PendingResponse>& responses = it->second.responses;
+			for(int j = 0; j < responses.size(); j ++) {
+				if(responses[j].kind == MEMBER_LISTING && responses[j].channel == channel) {
+					responses[j].channel = -1;
 				}
+				else if(responses[j].kind == MEMBER_LISTING && responses[j].channel == last) {
+					responses[j].channel = channel;
+				}
+			}
+		}
+		if(channel != last) {
+			std::vector<User>& members = allChannels[last].usersInChannel;
+			for(int j = 0; j < members.size(); j ++) {
+				std::vector<int>& channels = channelsOfUser[members[j].userFD];
+				std::replace(channels.begin(), channels.end(), last, channel);
+			}
+			std::swap(allChannels[channel], allChannels[last]);
+		}
+		allChannels.pop_back();
+	}
+	emptied.clear();
+}
+
+//This function returns true if name matches pattern, where '*' matches any run of characters and '?' matches
+// exactly one character
+bool globMatch(const char* pattern, const char* name) {
+	const char* starPattern = NULL;	//Position after the most recent '*', used to backtrack on a mismatch
+	const char* starName = NULL;
+	while(*name != '\0') {
+		if(*pattern == '*') {
+			starPattern = ++pattern;
+			starName = name;
+		}
+		else if(*pattern == '?' || *pattern == *name) {
+			pattern ++;
+			name ++;
+		}
+		else if(starPattern != NULL) {	//Let the last '*' swallow one more character and try again
+			pattern = starPattern;
+			name = ++starName;
+		}
+		else {
+			return false;
+		}
+	}
+	while(*pattern == '*') {
+		pattern ++;
+	}
+	return *pattern == '\0';
+}
+
+//This function parses the arguments of a LIST/WHO search ("<pattern> [<limit> [<after>]]\n") into pattern, limit
+// and after, returning false if they are malformed
+bool parseSearchArguments(const char* args, char* pattern, int* limit, char* after) {
+	char argsCopy[MAX_BUFFER_LENGTH];
+	strncpy(argsCopy, args, MAX_BUFFER_LENGTH - 1);
+	argsCopy[MAX_BUFFER_LENGTH - 1] = '\0';
+
+	char* givenPattern = strtok(argsCopy, " \n");
+	char* givenLimit = strtok(NULL, " \n");
+	char* givenAfter = strtok(NULL, " \n");
+	if(givenPattern == NULL || strtok(NULL, " \n") != NULL) {
+		return false;
+	}
+
+	if(strlen(givenPattern) > MAX_NAME_LENGTH - 1 || strspn(givenPattern, "#_0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ*?") != strlen(givenPattern)) {
+		return false;
+	}
+	strcpy(pattern, givenPattern);
+
+	*limit = DEFAULT_SEARCH_LIMIT;
+	if(givenLimit != NULL) {
+		char* end;
+		*limit = strtol(givenLimit, &end, 10);
+		if(*end != '\0' || *limit < 1 || *limit > MAX_SEARCH_LIMIT) {
+			return false;
+		}
+	}
+
+	after[0] = '\0';
+	if(givenAfter != NULL) {
+		if(strlen(givenAfter) > MAX_NAME_LENGTH - 1) {
+			return false;
+		}
+		strcpy(after, givenAfter);
+	}
+	return true;
+}
+
+//This function returns up to limit names from index that match pattern and sort after the pagination cursor after,
+// setting more if further matches remain...only the range of names sharing the pattern's literal prefix is visited
+std::vector<std::string> searchIndex(const std::set<std::string>& index, const char* pattern, const char* after, int limit, bool* more) {
+	std::string prefix(pattern, strcspn(pattern, "*?"));
 
-				//Remove the user
-				allChannels[i].usersInChannel.erase(allChannels[i].usersInChannel.begin() + j);
+	std::set<std::string>::const_iterator it = index.lower_bound(prefix);
+	if(after[0] != '\0' && prefix.compare(after) <= 0) {
+		it = index.upper_bound(after);
+	}
 
-				j = allChannels[i].usersInChannel.size() - 1;	//Breaks out of the inner loop
+	std::vector<std::string> results;
+	*more = false;
+	for( ; it != index.end() && it->compare(0, prefix.size(), prefix) == 0; it ++) {
+		if(globMatch(pattern, it->c_str())) {
+			if((int) results.size() == limit) {
+				*more = true;
+				break;
 			}
+			results.push_back(*it);
 		}
 	}
+	return results;
 }
 
-int main(int argc, char** argv) {
-	//Check to see if a valid password was provided
-	if(argc > 2) {
-		printf("Too many arguments provided.\nUsage: <executable> [--opt-pass=<password>]\n");
+//This function answers "<command> <pattern> [<limit> [<after>]]" by searching index and sending the matching names,
+// followed by the arguments to use for the next page if the limit cut the results short
+void sendSearchResults(int sockfd, const char* command, const char* args, const std::set<std::string>& index, const char* noun) {
+	char pattern[MAX_NAME_LENGTH];
+	char after[MAX_NAME_LENGTH];
+	int limit;
+	if(!parseSearchArguments(args, pattern, &limit, after)) {
+		char mesg[MAX_BUFFER_LENGTH];
+		int mesgLen = sprintf(mesg, "Malformed %s command - Usage: %s <pattern> [<limit 1-%d> [<after>]]\n", command, command, MAX_SEARCH_LIMIT);
+		sendToClient(sockfd, mesg, mesgLen);
+		return;
+	}
+
+	bool more;
+	std::vector<std::string> results = searchIndex(index, pattern, after, limit, &more);
+
+	//Build the whole response first so it goes out in a single write
+	char line[MAX_BUFFER_LENGTH];
+	sprintf(line, "Found %d %s matching %s:\n", (int) results.size(), noun, pattern);
+	std::string response(line);
+	for(int i = 0; i < results.size(); i ++) {
+		response += "* ";
+		response += results[i];
+		response += "\n";
+	}
+	if(more) {
+		sprintf(line, "More results available: %s %s %d %s\n", command, pattern, limit, results.back().c_str());
+		response += line;
+	}
+
+	sendToClient(sockfd, response.data(), response.size());
+}
+
+//This function creates a listening socket of the given family bound to addr and returns it, exiting with an error
+// message if that fails
+int openListener(int family, struct sockaddr* addr, socklen_t addrLen) {
+	int listenfd;
+	if((listenfd = socket(family, SOCK_STREAM, 0)) < 0) {
+		exitWithError("socket() error");
+	}
+
+	if(family == AF_INET) {	//Let a fixed port be reused straight away when the server is restarted
+		int on = 1;
+		setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	}
+
+	if(bind(listenfd, addr, addrLen) < 0) {
+		exitWithError("bind() error");
+	}
+
+	if(listen(listenfd, 5) < 0) {
+		exitWithError("listen() error");
+	}
+	return listenfd;
+}
+
+//This function creates a listening Unix domain socket at path, where a leading '@' puts the rest of the name in the
+// abstract namespace instead of the filesystem
+int openUnixListener(const char* path) {
+	struct sockaddr_un unaddr;
+	bzero(&unaddr, sizeof(unaddr));
+	unaddr.sun_family = AF_UNIX;
+
+	if(strlen(path) < 1 || strlen(path) >= sizeof(unaddr.sun_path)) {
+		printf("Unix socket path must have length from 1-%d characters.\n", (int) sizeof(unaddr.sun_path) - 1);
 		exit(-1);
 	}
-	if(argc == 2) {	//Check if the given command line argument is valid
-		int option_index = 0;
-		static struct option long_options[] = {
-			{"opt-pass", required_argument, 0, 0}
-		};
 
-		//If the command line argument is not valid, terminate the program (getopt_long() already prints an error message)
-		if(getopt_long(argc, argv, "", long_options, &option_index) == '?') {
-			exit(-1);
+	socklen_t addrLen;
+	if(path[0] == '@') {	//Abstract names start with a null byte and are not null terminated
+		memcpy(unaddr.sun_path + 1, path + 1, strlen(path) - 1);
+		addrLen = offsetof(struct sockaddr_un, sun_path) + strlen(path);
+	}
+	else {	//Replace a socket left behind by a previous run, but never some other kind of file
+		struct stat existing;
+		if(stat(path, &existing) == 0 && S_ISSOCK(existing.st_mode)) {
+			unlink(path);
 		}
+		strcpy(unaddr.sun_path, path);
+		addrLen = sizeof(unaddr);
+	}
 
-		//If a password was obtained, make sure it is a valid password
-		if(!std::regex_match(optarg, std::regex("[a-zA-Z][_0-9a-zA-Z]*"))) {
-			printf("Password does not match expected regular expression: [a-zA-Z][_0-9a-zA-Z]*\n");
+	return openListener(AF_UNIX, (struct sockaddr*) &unaddr, addrLen);
+}
+
+int main(int argc, char** argv) {
+	//Parse the command line options
+	int option_index = 0;
+	int opt;
+	int port = 0;	//0 lets the system pick a port, which is printed once the server is listening
+	std::vector<const char*> unixPaths;
+	const char* captureFileName = NULL;
+	const char* logFileName = NULL;
+	static struct option long_options[] = {
+		{"opt-pass", required_argument, 0, 'p'},
+		{"capture", required_argument, 0, 'c'},
+		{"port", required_argument, 0, 't'},
+		{"unix", required_argument, 0, 'u'},
+		{"log", required_argument, 0, 'l'},
+		{"memory-limit", required_argument, 0, 'm'},
+		{"max-channels", required_argument, 0, 'j'},
+		{"max-members", required_argument, 0, 'n'},
+		{"max-output", required_argument, 0, 'o'},
+		{"trace", required_argument, 0, 'T'},
+		{"trace-sample", required_argument, 0, 's'},
+		{0, 0, 0, 0}
+	};
+
+	while((opt = getopt_long(argc, argv, "", long_options, &option_index)) != -1) {
+		//If a command line argument is not valid, terminate the program (getopt_long() already prints an error message)
+		if(opt == '?') {
 			exit(-1);
 		}
-		else {	//Ensure password is of a valid length
-			if(strlen(optarg) > 20) {
-				printf("Password must have length from 1-20 characters.\n");
+		else if(opt == 'p') {	//Check to see if a valid password was provided
+			//If a password was obtained, make sure it is a valid password
+			if(!std::regex_match(optarg, std::regex("[a-zA-Z][_0-9a-zA-Z]*"))) {
+				printf("Password does not match expected regular expression: [a-zA-Z][_0-9a-zA-Z]*\n");
+				exit(-1);
+			}
+			else {	//Ensure password is of a valid length
+				if(strlen(optarg) > 20) {
+					printf("Password must have length from 1-20 characters.\n");
+					exit(-1);
+				}
+				else {	//Everything is valid, set the password of the server equal to optarg
+					strcpy(password, optarg);
+					password[strlen(optarg)] = '\0';
+				}
+			}
+		}
+		else if(opt == 'c') {	//Record all inbound traffic to the given file for later replay
+			captureFileName = optarg;
+		}
+		else if(opt == 't') {	//Listen for TCP clients on a fixed port
+			char* end;
+			port = strtol(optarg, &end, 10);
+			if(*end != '\0' || port < 0 || port > 65535) {
+				printf("Port must be a number from 0-65535.\n");
+				exit(-1);
+			}
+		}
+		else if(opt == 'u') {	//Also listen for local clients on a Unix domain socket, may be given more than once
+			unixPaths.push_back(optarg);
+		}
+		else if(opt == 'l') {	//Record connections, registrations, channel changes and errors to the given file
+			logFileName = optarg;
+		}
+		else if(opt == 'm' || opt == 'o') {	//Refuse new connections and JOINs once this much memory is in use, or disconnect
+												// clients that fall this far behind on their output, with an optional K, M or G suffix
+			char* end;
+			long long limit = strtoll(optarg, &end, 10);
+			if(*end == 'K' || *end == 'M' || *end == 'G') {
+				limit <<= (*end == 'K' ? 10 : *end == 'M' ? 20 : 30);
+				end ++;
+			}
+			if(*end != '\0' || end == optarg || limit < 1) {
+				printf("Memory and output limits must be a positive number of bytes, optionally followed by K, M or G.\n");
+				exit(-1);
+			}
+			(opt == 'm' ? memoryLimit : maxOutput) = limit;
+		}
+		else if(opt == 'j' || opt == 'n') {	//Limit the channels each user may be in, or the members each channel may have
+			char* end;
+			int limit = strtol(optarg, &end, 10);
+			if(*end != '\0' || end == optarg || limit < 1) {
+				printf("Channel and member limits must be positive numbers.\n");
 				exit(-1);
 			}
-			else {	//Everything is valid, set the password of the server equal to optarg
-				strcpy(password, optarg);
-				password[strlen(optarg)] = '\0';
+			(opt == 'j' ? maxChannelsPerUser : maxChannelMembers) = limit;
+		}
+		else if(opt == 'T' || opt == 's') {	//Record sampled spans, written to the given file on SIGUSR1 or TRACE
+#ifdef IRC_TRACING
+			if(opt == 'T') {
+				traceFileName = optarg;
 			}
+			else {	//Trace one pass of the event loop in every traceSampleRate
+				char* end;
+				traceSampleRate = strtol(optarg, &end, 10);
+				if(*end != '\0' || end == optarg || traceSampleRate < 1) {
+					printf("Trace sample rate must be a positive number.\n");
+					exit(-1);
+				}
+			}
+#else
+			printf("This server was built without tracing, rebuild it with -DIRC_TRACING.\n");
+			exit(-1);
+#endif
 		}
 	}
+	if(optind < argc) {
+		printf("Too many arguments provided.\nUsage: <executable> [--opt-pass=<password>] [--capture=<file>] [--port=<port>] [--unix=<path or @abstract name>]... [--log=<file>] [--memory-limit=<bytes>] [--max-channels=<count>] [--max-members=<count>] [--max-output=<bytes>] [--trace=<file>] [--trace-sample=<1 in N passes>]\n");
+		exit(-1);
+	}
+
+	//Start the writer threads only once every option is in place, since they read the tracing settings
+	if(logFileName != NULL) {	//First, so that the capture failing to start is logged
+		startLog(logFileName);
+	}
+	if(captureFileName != NULL) {
+		startCapture(captureFileName);
+	}
 
 
-	int 		i, j, maxfd, listenfd, connfd, sockfd;
+	int 		i, j, maxfd, connfd, sockfd;
 	int 		nready;
 	ssize_t 	n;
-	fd_set 		rset, allset;
+	fd_set 		rset, wset, allset;
 	char 		buf[MAX_BUFFER_LENGTH];
 	socklen_t 	clilen;
-	struct 		sockaddr_in cliaddr, servaddr;
-
-	if((listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-		perror("socket() error");
-		exit(-1);
-	}
+	struct 		sockaddr_storage cliaddr;
+	struct 		sockaddr_in servaddr;
+	std::vector<int> listenFDs;	//The TCP listener followed by any Unix domain listeners, all served by the same loop
 
 	bzero(&servaddr, sizeof(servaddr));
 	servaddr.sin_family = AF_INET;
 	servaddr.sin_addr.s_addr = htonl(0);
-	servaddr.sin_port = htons(0);
+	servaddr.sin_port = htons(port);
+	listenFDs.push_back(openListener(AF_INET, (struct sockaddr*) &servaddr, sizeof(servaddr)));
 
-	if(bind(listenfd, (struct sockaddr*) &servaddr, sizeof(servaddr)) < 0) {
-		perror("bind() error");
-		exit(-1);
+	for(i = 0; i < unixPaths.size(); i ++) {
+		listenFDs.push_back(openUnixListener(unixPaths[i]));
 	}
 
 	//Print out port number
 	socklen_t len = sizeof(servaddr);
-	getsockname(listenfd, (struct sockaddr*) &servaddr, &len);
+	getsockname(listenFDs[0], (struct sockaddr*) &servaddr, &len);
 	printf("%d\n", ntohs(servaddr.sin_port));
 
-	if(listen(listenfd, 5) < 0) {
-		perror("listen() error");
-		exit(-1);
+	maxfd = -1; //Initialize
+	FD_ZERO(&allset);
+	for(i = 0; i < listenFDs.size(); i ++) {
+		FD_SET(listenFDs[i], &allset);
+		maxfd = std::max(maxfd, listenFDs[i]);
 	}
 
-	maxfd = listenfd; //Initialize
-	FD_ZERO(&allset);
-	FD_SET(listenfd, &allset);
+#ifdef IRC_TRACING
+	if(traceFileName != NULL) {
+		struct sigaction action;
+		bzero(&action, sizeof(action));
+		action.sa_handler = requestTraceDump;	//Without SA_RESTART, so the signal wakes select()
+		sigaction(SIGUSR1, &action, NULL);
+	}
+#endif
+	TRACE_THREAD("event loop");
 
 	for( ; ; ) {
+		TRACE_SAMPLE();
+#ifdef IRC_TRACING
+		if(traceDumpRequested) {	//SIGUSR1 asked for the trace
+			traceDumpRequested = 0;
+			if(!dumpTrace()) {
+				perror("Trace could not be written");
+			}
+		}
+#endif
+
+		//Disconnect clients that fell more than maxOutput behind on their output, they are removed at the end of the pass
+		for(std::map<int, ClientOutput>::iterator it = clientOutputs.begin(); it != clientOutputs.end(); it ++) {
+			if(it->second.overflowed && FD_ISSET(it->first, &allset)) {
+				logEvent("ERROR", "fd=%d reason=output_limit", it->first);
+				disconnectedFDs.push_back(it->first);
+				FD_CLR(it->first, &allset);
+				std::replace(allClients.begin(), allClients.end(), it->first, -1);
+			}
+		}
+
 		rset = allset;	//Structure assignment
-		if((nready = select(maxfd + 1, &rset, NULL, NULL, NULL)) < 0) {
-			perror("select() failed");
-			exit(-1);
+
+		//Wait for writability only on clients that have output queued, dropping output for clients that have since closed
+		FD_ZERO(&wset);
+		for(std::map<int, ClientOutput>::iterator it = clientOutputs.begin(); it != clientOutputs.end(); ) {
+			if(FD_ISSET(it->first, &allset)) {
+				FD_SET(it->first, &wset);
+				it ++;
+			}
+			else {
+				int closedFD = (it ++)->first;
+				dropClientOutput(closedFD);
+			}
+		}
+
+		//Shed load at the memory limit by not reading commands from clients that still have output waiting, so they
+		// cannot queue any more until what they have drains
+		if(overMemoryLimit()) {
+			for(std::map<int, ClientOutput>::iterator it = clientOutputs.begin(); it != clientOutputs.end(); it ++) {
+				FD_CLR(it->first, &rset);
+			}
+		}
+
+		{
+			TRACE_SPAN("select", -1);
+			nready = select(maxfd + 1, &rset, &wset, NULL, NULL);
+		}
+		if(nready < 0) {
+			if(errno == EINTR) {	//Interrupted by a signal, such as SIGUSR1 asking for the trace
+				continue;
+			}
+			exitWithError("select() failed");
 		}
 
-		if(FD_ISSET(listenfd, &rset)) {	//New client connection
+		//Send the next chunk of queued output to each client that can take it
+		std::vector<int> writableFDs;
+		for(std::map<int, ClientOutput>::iterator it = clientOutputs.begin(); it != clientOutputs.end(); it ++) {
+			if(FD_ISSET(it->first, &wset)) {
+				writableFDs.push_back(it->first);
+			}
+		}
+		for(j = 0; j < writableFDs.size(); j ++) {
+			flushClientOutput(writableFDs[j]);
+			nready --;
+		}
+
+		for(j = 0; j < listenFDs.size(); j ++) {	//New client connection, over TCP or a Unix domain socket
+			if(!FD_ISSET(listenFDs[j], &rset)) {
+				continue;
+			}
+			TRACE_SPAN("accept", -1);
 			clilen = sizeof(cliaddr);
-			if((connfd = accept(listenfd, (struct sockaddr*) &cliaddr, &clilen)) < 0) {
-				perror("accept() failed");
-				exit(-1);
+			if((connfd = accept(listenFDs[j], (struct sockaddr*) &cliaddr, &clilen)) < 0) {
+				exitWithError("accept() failed");
+			}
+
+			//Shed load by turning new clients away while the server is at its memory limit
+			if(overMemoryLimit()) {
+				send(connfd, "The server is full, try again later.\n", 37, MSG_DONTWAIT | MSG_NOSIGNAL);
+				logEvent("ERROR", "fd=%d reason=memory_limit", connfd);
+				close(connfd);
+				nready --;
+				continue;
 			}
 
 			//If any of the spots in allClients are available, fill it
@@ -195,30 +1391,38 @@ int main(int argc, char** argv) {
 				allClients.push_back(connfd);
 			}
 
+			chargeConnection(connfd, CONNECTION_BYTES);
+			captureEvent(connfd, CAPTURE_CONNECT, NULL, 0);
+			logEvent("CONNECT", "fd=%d transport=%s", connfd, j == 0 ? "tcp" : "unix");
 			FD_SET(connfd, &allset);	//Add new descriptor to set
 			if(connfd > maxfd)
 				maxfd = connfd;			//For select
 
-			if(--nready <= 0)
-				continue;
+			nready --;
 		}
+		if(nready <= 0)
+			continue;
 
 		for(i = 0; i < allClients.size(); i ++) {	//Check all clients for data
 			if((sockfd = allClients[i]) < 0) {
 				continue;
 			}
 			if(FD_ISSET(sockfd, &rset)) {
-				if((n = read(sockfd, buf, MAX_BUFFER_LENGTH)) == 0) {	//Connection closed by client
-
-					//Remove all instances of the disconnected user from our data
-					removeInstances(sockfd);
+				{
+					TRACE_SPAN("read", sockfd);
+					n = read(sockfd, buf, MAX_BUFFER_LENGTH - 1);
+				}
+				if(n <= 0) {	//Connection closed (or reset) by client
+					logEvent("DISCONNECT", "fd=%d", sockfd);
 
-					//Close the socket and reflect change for select loop
-					close(sockfd);
+					//Remove all instances of the disconnected user from our data and close the socket at the end of
+					// this pass, then reflect change for select loop
+					disconnectedFDs.push_back(sockfd);
 					FD_CLR(sockfd, &allset);
 					allClients[i] = -1;
 				}
 				else {
+					captureEvent(sockfd, CAPTURE_DATA, buf, n);
 					buf[n] = '\0';
 
 					//Determine which command the user is trying to execute, everything is CASE-SENSITIVE
@@ -227,17 +1431,22 @@ int main(int argc, char** argv) {
 					if(!userExists(sockfd)) {
 						//If the user does not yet exist, the only valid command we can receive is "USER <nickname>"
 						//If the command entered is valid, create new user...otherwise, disconnect the client with an error message
+						TRACE_SPAN("register", sockfd);
 
 						if(n < 7 || n > 26) {	//No need to check further than this, since a valid USER command will have length of at least 7 (USER (4) + space (1) + name (1) + \n(1))
 												//	and no more than 26 (USER (4) + space (1) + name (20) + \n (1))
-							write(sockfd, "Invalid command, please identify yourself with USER.\n", 53);
+							sendToClient(sockfd, "Invalid command, please identify yourself with USER.\n", 53);
+							logEvent("ERROR", "fd=%d reason=not_registered", sockfd);
+							forgetConnection(sockfd);
 							close(sockfd);
 							FD_CLR(sockfd, &allset);
 							allClients[i] = -1;
 						}
 						else {
 							if(!(buf[0] == 'U' && buf[1] == 'S' && buf[2] == 'E' && buf[3] == 'R' && buf[4] == ' ')) {	//Command given is not USER
-								write(sockfd, "Invalid command, please identify yourself with USER.\n", 53);
+								sendToClient(sockfd, "Invalid command, please identify yourself with USER.\n", 53);
+								logEvent("ERROR", "fd=%d reason=not_registered", sockfd);
+								forgetConnection(sockfd);
 								close(sockfd);
 								FD_CLR(sockfd, &allset);
 								allClients[i] = -1;								
@@ -250,43 +1459,43 @@ int main(int argc, char** argv) {
 								givenName[j - 5] = '\0';
 
 								if(!std::regex_match(givenName, std::regex("[a-zA-Z][_0-9a-zA-Z]*"))) {
-									write(sockfd, "Invalid nickname, try again.\n", 29);
+									sendToClient(sockfd, "Invalid nickname, try again.\n", 29);
+									logEvent("ERROR", "fd=%d reason=invalid_nickname", sockfd);
+									forgetConnection(sockfd);
 									close(sockfd);
 									FD_CLR(sockfd, &allset);
 									allClients[i] = -1;
 								}
-								else {	//Check if no other user has the same name
-									bool nameTaken = false;
-									for(j = 0; j < allUsers.size(); j ++) {
-										if(strcmp(allUsers[j].userName, givenName) == 0) {
-											nameTaken = true;
-											j = allUsers.size() - 1;	//No need to keep searching
-										}
-									}
+								else {	//Check if no other user has the same name...nicknames cannot start with '#', so an interned
+										// name matching this one can only belong to a user
+									bool nameTaken = lookupName(givenName) != -1;
 
 									if(nameTaken) {
-										write(sockfd, "Name already taken.\n", 20);
+										sendToClient(sockfd, "Name already taken.\n", 20);
+										logEvent("ERROR", "fd=%d reason=nickname_taken nick=%s", sockfd, givenName);
+										forgetConnection(sockfd);
 										close(sockfd);
 										FD_CLR(sockfd, &allset);
 										allClients[i] = -1;
 									}
 									else {	//We can create the new user
 										struct User user;
-										for(j = 0; j < MAX_NAME_LENGTH; j ++) {
-											user.userName[j] = givenName[j];
-										}
-										user.userNameLength = n - 6;
+										user.nameID = internName(givenName);
 										user.isOperator = false;
 										user.userFD = sockfd;
+										user.joinSerial = 0;
 										allUsers.push_back(user);
+										userIndex.insert(nameText(user.nameID));
+										chargeConnection(sockfd, USER_BYTES);
+										logEvent("REGISTER", "fd=%d nick=%s", sockfd, givenName);
 
 										//Send a welcome message to the new user
-										int mesgLen = 11 + user.userNameLength;
+										int mesgLen = 11 + nameLength(user.nameID);
 										char mesg[mesgLen];
 										strcpy(mesg, "Welcome, ");
-										strcat(mesg, user.userName);
+										strcat(mesg, nameText(user.nameID));
 										strcat(mesg, ".\n");
-										write(sockfd, mesg, mesgLen);
+										sendToClient(sockfd, mesg, mesgLen);
 									}
 								}
 							}
@@ -295,9 +1504,11 @@ int main(int argc, char** argv) {
 					else {	//User already exists, parse the input, then either execute the command or send an appropriate error message
 						
 						//Any valid command will have length of at least 5 ("LIST\n", "PART\n", and "QUIT\n" are the shortest valid commands)
-						// and no more than 542 ("PRIVMSG <20 character name> <512 character message>\n")
-						if(n < 5 || n > 542) {
-							write(sockfd, "Invalid command.\n", 17);
+						// and no more than 542 ("PRIVMSG <20 character name> <512 character message>\n"), except for a PRIVMSG
+						// with several targets which is checked against the full target list length below...a bare "WHO\n" is let
+						// through so that it gets WHO's usage message
+						if((n < 5 && strcmp(buf, "WHO\n") != 0) || (n > 542 && strncmp(buf, "PRIVMSG ", 8) != 0)) {
+							sendToClient(sockfd, "Invalid command.\n", 17);
 						}
 						else {	//Now that we know the input is of a valid length, parse the first word and act accordingly
 							char firstWord[MAX_BUFFER_LENGTH];
@@ -305,12 +1516,15 @@ int main(int argc, char** argv) {
 								firstWord[j] = buf[j];
 							}
 							firstWord[j] = '\0';
+							TRACE_SPAN(traceCommandName(firstWord), sockfd);
 
 							if(strcmp(firstWord, "USER") == 0) {
-								write(sockfd, "You cannot change your username.\n", 33);
+								sendToClient(sockfd, "You cannot change your username.\n", 33);
 							}
 							else if(strcmp(firstWord, "LIST") == 0) {
 								if(j == n - 1) {	//If the input was simply "LIST\n", print out all available channels
+									//The count is a snapshot taken now, while the names are read live from channelIndex as the
+									// listing streams...channels created or removed meanwhile can make the two disagree
 									int numChannels = allChannels.size();
 									char numChannelsAsString[MAX_BUFFER_LENGTH];
 									sprintf(numChannelsAsString, "%d", numChannels);
@@ -323,21 +1537,18 @@ int main(int argc, char** argv) {
 									strcat(mesg, numChannelsAsString);
 									strcat(mesg, " channel(s):\n");
 
-									write(sockfd, mesg, mesgLen);
+									sendToClient(sockfd, mesg, mesgLen);
 
-									for(j = 0; j < allChannels.size(); j ++) {	//Send the name of each channel to the user
-										bzero(&mesg, MAX_BUFFER_LENGTH);
-										mesgLen = 3 + allChannels[j].channelNameLength;
-										strcpy(mesg, "* ");
-										strcat(mesg, allChannels[j].channelName);
-										strcat(mesg, "\n");
-
-										write(sockfd, mesg, mesgLen);
-									}
+									//The name of each channel is streamed to the user by the event loop, in name order rather than
+									// the order the channels were created in
+									queueListing(sockfd, CHANNEL_LISTING, -1);
+								}
+								else if(strpbrk(buf + 5, "*?") != NULL) {	//A wildcard makes this a channel search ("LIST <pattern> [<limit> [<after>]]\n")
+									sendSearchResults(sockfd, "LIST", buf + 5, channelIndex, "channel(s)");
 								}
 								else {	//Check if the provided channel name is valid
 									if(n > 26) {	//A valid LIST command will have length no more than 26 (LIST <20 char channel name>\n)
-										write(sockfd, "Channel name must have length 1-20.\n", 36);
+										sendToClient(sockfd, "Channel name must have length 1-20.\n", 36);
 									}
 									else {	//Valid length, check that the channel exists
 										char givenName[MAX_NAME_LENGTH];
@@ -345,10 +1556,11 @@ int main(int argc, char** argv) {
 											givenName[j - 5] = buf[j];
 										}
 										givenName[j - 5] = '\0';
+										int givenID = lookupName(givenName);
 
 										bool channelExists = false;
 										for(j = 0; j < allChannels.size(); j ++) {
-											if(strcmp(allChannels[j].channelName, givenName) == 0) {	//Channel exists, list all users in the channel
+											if(allChannels[j].nameID == givenID) {	//Channel exists, list all users in the channel
 												channelExists = true;
 
 												int numUsers = allChannels[j].usersInChannel.size();
@@ -357,45 +1569,46 @@ int main(int argc, char** argv) {
 												int numDigitsInUserCount = numDigits(numUsers);
 												numUsersAsString[numDigitsInUserCount] = '\0';
  
-												int mesgLen = 36 + numDigitsInUserCount + allChannels[j].channelNameLength;
-												char mesg[mesgLen];
+												int mesgLen = 36 + numDigitsInUserCount + nameLength(allChannels[j].nameID);
+												char mesg[MAX_BUFFER_LENGTH];
 												strcpy(mesg, "There are currently ");
 												strcat(mesg, numUsersAsString);
 												strcat(mesg, " member(s) in ");
-												strcat(mesg, allChannels[j].channelName);
+												strcat(mesg, nameText(allChannels[j].nameID));
 												strcat(mesg, ":\n");
 
-												write(sockfd, mesg, mesgLen);
-
-												for(int k = 0; k < allChannels[j].usersInChannel.size(); k ++) {
-													bzero(&mesg, mesgLen);
-													mesgLen = 3 + allChannels[j].usersInChannel[k].userNameLength;
-													strcpy(mesg, "* ");
-													strcat(mesg, allChannels[j].usersInChannel[k].userName);
-													strcat(mesg, "\n");
+												sendToClient(sockfd, mesg, mesgLen);
 
-													write(sockfd, mesg, mesgLen);
-												}
+												//The name of each member is streamed to the user by the event loop
+												queueListing(sockfd, MEMBER_LISTING, j);
 
 												j = allChannels.size() - 1;
 											}
 										}
 
 										if(!channelExists) {
-											write(sockfd, "There are no channels with the name you have given.\n", 52);
+											sendToClient(sockfd, "There are no channels with the name you have given.\n", 52);
 										}
 									}
 								}
 							}
+							else if(strcmp(firstWord, "WHO") == 0) {
+								if(j == n - 1 || buf[j] != ' ') {
+									sendToClient(sockfd, "Malformed WHO command - Usage: WHO <pattern> [<limit> [<after>]]\n", 65);
+								}
+								else {	//Search the nicknames ("WHO <pattern> [<limit> [<after>]]\n")
+									sendSearchResults(sockfd, "WHO", buf + 4, userIndex, "user(s)");
+								}
+							}
 							else if(strcmp(firstWord, "JOIN") == 0) {
 
 								//A valid JOIN command will have length between 7 ("JOIN #\n") and 26 ("JOIN <20 char channel name>\n")
 								if(n < 7 || n > 26) {
-									write(sockfd, "Channel name must have length 1-20.\n", 36);
+									sendToClient(sockfd, "Channel name must have length 1-20.\n", 36);
 								}
 								else {	//Make sure a space comes after JOIN
 									if(buf[j] != ' ') {
-										write(sockfd, "Malformed JOIN command - Usage: JOIN <#channelname>\n", 52);
+										sendToClient(sockfd, "Malformed JOIN command - Usage: JOIN <#channelname>\n", 52);
 									}
 									else {	//Parse given channel name and make sure that it is valid
 										char givenName[MAX_NAME_LENGTH];
@@ -405,7 +1618,7 @@ int main(int argc, char** argv) {
 										givenName[j - 5] = '\0';
 
 										if(!std::regex_match(givenName, std::regex("#[a-zA-Z][_0-9a-zA-Z]*"))) {
-											write(sockfd, "Channel name does not match expected regular expression: #[a-zA-Z][_0-9a-zA-Z]*\n", 80);
+											sendToClient(sockfd, "Channel name does not match expected regular expression: #[a-zA-Z][_0-9a-zA-Z]*\n", 80);
 										}
 										else {	//If the channel exists, join it...otherwise, create the channel and join it
 											bool channelExists = false;
@@ -418,183 +1631,146 @@ int main(int argc, char** argv) {
 													j = allUsers.size() - 1;
 												}
 											}
+											userToAdd.joinSerial = ++ lastJoinSerial;
 
+											int givenID = lookupName(givenName);
 											for(j = 0; j < allChannels.size(); j ++) {
-												if(strcmp(allChannels[j].channelName, givenName) == 0) {	//Channel exists
+												if(allChannels[j].nameID == givenID) {	//Channel exists
 													channelExists = true;
 
 													//Ensure that the user is not already a member of this channel
-													bool alreadyIn = false;
-													for(int k = 0; k < allChannels[j].usersInChannel.size(); k ++) {
-														if(strcmp(allChannels[j].usersInChannel[k].userName, userToAdd.userName) == 0) {
-															alreadyIn = true;
-															write(sockfd, "You are already a member of this channel.\n", 42);
-														}
+													std::vector<int>& channels = channelsOfUser[sockfd];
+													bool alreadyIn = std::find(channels.begin(), channels.end(), j) != channels.end();
+													if(alreadyIn) {
+														sendToClient(sockfd, "You are already a member of this channel.\n", 42);
 													}
 
-													if(!alreadyIn) {
-														int mesgLen = 27 + allChannels[j].channelNameLength + userToAdd.userNameLength;
+													//Respect the channel and per-user limits, and shed load at the memory limit
+													const char* refusal = alreadyIn ? NULL : joinRefusal(sockfd, allChannels[j].usersInChannel.size());
+													if(refusal != NULL) {
+														sendToClient(sockfd, refusal, strlen(refusal));
+														logEvent("ERROR", "fd=%d reason=join_refused channel=%s", sockfd, givenName);
+													}
+
+													if(!alreadyIn && refusal == NULL) {
+														int mesgLen = 27 + nameLength(allChannels[j].nameID) + nameLength(userToAdd.nameID);
 														char mesg[mesgLen];
-														strcpy(mesg, allChannels[j].channelName);
+														strcpy(mesg, nameText(allChannels[j].nameID));
 														strcat(mesg, "> ");
-														strcat(mesg, userToAdd.userName);
+														strcat(mesg, nameText(userToAdd.nameID));
 														strcat(mesg, " has joined the channel.\n");
 
 														//Notify all other users of the channel of the new member
 														for(int k = 0; k < allChannels[j].usersInChannel.size(); k ++) {
-															write(allChannels[j].usersInChannel[k].userFD, mesg, mesgLen);
+															sendToClient(allChannels[j].usersInChannel[k].userFD, mesg, mesgLen);
 														}
 
 														//Add the user to the channel
 														allChannels[j].usersInChannel.push_back(userToAdd);
+														channels.push_back(j);
+														chargeChannel(j, MEMBER_BYTES);
+														chargeConnection(sockfd, MEMBERSHIP_BYTES);
+														logEvent("JOIN", "fd=%d nick=%s channel=%s", sockfd, nameText(userToAdd.nameID), givenName);
 
 														//Send confirmation message to the user
 														bzero(&mesg, mesgLen);
-														mesgLen = 16 + allChannels[j].channelNameLength;
+														mesgLen = 16 + nameLength(allChannels[j].nameID);
 														strcpy(mesg, "Joined channel ");
-														strcat(mesg, allChannels[j].channelName);
+														strcat(mesg, nameText(allChannels[j].nameID));
 														strcat(mesg, "\n");
 
-														write(sockfd, mesg, mesgLen);
+														sendToClient(sockfd, mesg, mesgLen);
 
 														//We can break out of the loop because there can only be 1 channel of the given name
 														j = allChannels.size() - 1;
 													}
 												}
 											}
-											if(!channelExists) {	//Create a new channel with the given name
+											const char* refusal = channelExists ? NULL : joinRefusal(sockfd, 0);
+											if(refusal != NULL) {
+												sendToClient(sockfd, refusal, strlen(refusal));
+												logEvent("ERROR", "fd=%d reason=join_refused channel=%s", sockfd, givenName);
+											}
+											else if(!channelExists) {	//Create a new channel with the given name
 												struct Channel channel;
-												for(j = 0; j < MAX_NAME_LENGTH; j ++) {
-													channel.channelName[j] = givenName[j];
-												}
-												channel.channelNameLength = n - 6;
+												channel.nameID = internName(givenName);
 												channel.usersInChannel.push_back(userToAdd);
+												channel.memory = 0;
 												allChannels.push_back(channel);
+												channelsOfUser[sockfd].push_back(allChannels.size() - 1);
+												chargeChannel(allChannels.size() - 1, CHANNEL_BYTES + MEMBER_BYTES);
+												chargeConnection(sockfd, MEMBERSHIP_BYTES);
+												logEvent("JOIN", "fd=%d nick=%s channel=%s created=1", sockfd, nameText(userToAdd.nameID), givenName);
+												channelIndex.insert(nameText(channel.nameID));
 
 												//Send confirmation message to the user
-												int mesgLen = 16 + channel.channelNameLength;
+												int mesgLen = 16 + nameLength(channel.nameID);
 												char mesg[mesgLen];
 												strcpy(mesg, "Joined channel ");
-												strcat(mesg, channel.channelName);
+												strcat(mesg, nameText(channel.nameID));
 												strcat(mesg, "\n");
 
-												write(sockfd, mesg, mesgLen);
+												sendToClient(sockfd, mesg, mesgLen);
 											}
 										}
 									}
 								}
 							}
 							else if(strcmp(firstWord, "PART") == 0) {
-								if(j == n - 1) {	//If the input was simply "PART\n" then remove the user from all channels and notify the members
-													// of the channels that they have left
-
-									//For each channel, remove the user if they are there
-									//We can break in the inner loop because each channel will have at most one instance of the disconnected user
-									for(int k = 0; k < allChannels.size(); k ++) {
-										for(int l = 0; l < allChannels[k].usersInChannel.size(); l ++) {
-											if(allChannels[k].usersInChannel[l].userFD == sockfd) {
-
-												//Notify other members of the channel that the user has left the channel
-												int mesgLen = 25 + allChannels[k].channelNameLength + allChannels[k].usersInChannel[l].userNameLength;
-												char mesg[mesgLen];
-												strcpy(mesg, allChannels[k].channelName);
-												strcat(mesg, "> ");
-												strcat(mesg, allChannels[k].usersInChannel[l].userName);
-												strcat(mesg, " has left the channel.\n");
-
-												for(int m = 0; m < allChannels[k].usersInChannel.size(); m ++) {
-
-													if(m != l) {	//Don't send the message to the disconnecting user
-														write(allChannels[k].usersInChannel[m].userFD, mesg, mesgLen);
-													}
-												}
-
-												//Remove the user
-												allChannels[k].usersInChannel.erase(allChannels[k].usersInChannel.begin() + l);
-
-												l = allChannels[k].usersInChannel.size() - 1;	//Breaks out of the inner loop
-											}
-										}
+								if(j == n - 1) {	//If the input was simply "PART\n" then remove the user from all of their channels and notify
+													// the members of those channels that they have left
+									std::vector<int> departing(1, sockfd);
+									std::vector<int>& channels = channelsOfUser[sockfd];
+									for(int k = 0; k < channels.size(); k ++) {
+										removeFromChannel(channels[k], departing);
+										logEvent("PART", "fd=%d channel=%s", sockfd, nameText(allChannels[channels[k]].nameID));
 									}
+									chargeConnection(sockfd, -(long) (channels.size() * MEMBERSHIP_BYTES));
+									channels.clear();
 								}
 								else {
 									if(n > 26) {	//A valid LIST command will have length no more than 26 (LIST <20 char channel name>\n)
-										write(sockfd, "Channel name must have length 1-20.\n", 36);
+										sendToClient(sockfd, "Channel name must have length 1-20.\n", 36);
 									}
-									else {	//Valid length, check that the channel exists
+									else {	//Valid length, check that the channel exists...nicknames cannot start with '#', so an interned
+											// name that does can only belong to a channel
 										char givenName[MAX_NAME_LENGTH];
 										for(j = 5; j < n - 1; j ++) {
 											givenName[j - 5] = buf[j];
 										}
 										givenName[j - 5] = '\0';
+										int givenID = lookupName(givenName);
 
-										bool channelExists = false;
-
-										//Get this user
-										struct User userToRemove;
-										for(j = 0; j < allUsers.size(); j ++) {
-											if(allUsers[j].userFD == sockfd) {
-												userToRemove = allUsers[j];
-												j = allUsers.size() - 1;
-											}
+										if(givenID == -1 || givenName[0] != '#') {
+											sendToClient(sockfd, "There are no channels with the name you have given.\n", 52);
 										}
-
-										for(j = 0; j < allChannels.size(); j ++) {
-											if(strcmp(allChannels[j].channelName, givenName) == 0) {	//Channel exists, remove the user from the channel
-												channelExists = true;
-
-												//Check if the user is a member of the given channel or not
-												bool alreadyIn = false;
-												for(int k = 0; k < allChannels[j].usersInChannel.size(); k ++) {
-													if(strcmp(allChannels[j].usersInChannel[k].userName, userToRemove.userName) == 0) {
-														alreadyIn = true;
-													}
+										else {	//Check if the user is a member of the given channel using the user's channel index
+											int channel = -1;
+											std::vector<int>& channels = channelsOfUser[sockfd];
+											for(int k = 0; k < channels.size(); k ++) {
+												if(allChannels[channels[k]].nameID == givenID) {
+													channel = channels[k];
 												}
+											}
 
-												//If they are a member of the given channel, remove them and notify the other members...
-												// otherwise, send an error message
-												if(!alreadyIn) {
-													write(sockfd, "You are not a member of that channel.\n", 38);
-												}
-												else {
-													for(int k = 0; k < allChannels[j].usersInChannel.size(); k ++) {
-														if(allChannels[j].usersInChannel[k].userFD == sockfd) {
-
-															//Notify other members of the channel that the user has left the channel
-															int mesgLen = 25 + allChannels[j].channelNameLength + allChannels[j].usersInChannel[k].userNameLength;
-															char mesg[mesgLen];
-															strcpy(mesg, allChannels[j].channelName);
-															strcat(mesg, "> ");
-															strcat(mesg, allChannels[j].usersInChannel[k].userName);
-															strcat(mesg, " has left the channel.\n");
-
-															for(int l = 0; l < allChannels[j].usersInChannel.size(); l ++) {
-
-																if(l != k) {	//Don't send the message to the disconnecting user
-																	write(allChannels[j].usersInChannel[l].userFD, mesg, mesgLen);
-																}
-															}
-
-															//Remove the user
-															allChannels[j].usersInChannel.erase(allChannels[j].usersInChannel.begin() + k);
-
-															k = allChannels[j].usersInChannel.size() - 1;	//Breaks out of the inner loop
-														}
-													}	
-												}
+											//If they are a member of the given channel, remove them and notify the other members...
+											// otherwise, send an error message
+											if(channel == -1) {
+												sendToClient(sockfd, "You are not a member of that channel.\n", 38);
+											}
+											else {
+												removeFromChannel(channel, std::vector<int>(1, sockfd));
+												logEvent("PART", "fd=%d channel=%s", sockfd, givenName);
+												forgetChannel(sockfd, channel);
 											}
 										}
-
-										if(!channelExists) {
-											write(sockfd, "There are no channels with the name you have given.\n", 52);
-										}											
-									}																														
+									}
 								}
 							}
 							else if(strcmp(firstWord, "OPERATOR") == 0) {
 								//If the server has no password, then no user can become an operator
 								if(strcmp(password, "") == 0) {
-									write(sockfd, "This server has no password, no user can become an operator.\n", 61);
+									sendToClient(sockfd, "This server has no password, no user can become an operator.\n", 61);
 								}
 								else {
 									//If the user is already an operator, just send an error message
@@ -602,7 +1778,7 @@ int main(int argc, char** argv) {
 									for(int k = 0; k < allUsers.size(); k ++) {
 										if(allUsers[k].userFD == sockfd) {
 											if(allUsers[k].isOperator) {
-												write(sockfd, "You are already an operator.\n", 29);
+												sendToClient(sockfd, "You are already an operator.\n", 29);
 												alreadyOperator = true;
 											}
 											k = allUsers.size() - 1;
@@ -613,7 +1789,7 @@ int main(int argc, char** argv) {
 										//A valid OPERATOR command will have at least 11 characters (OPERATOR <1 char password>\n)
 										//and at most 30 characters (OPERATOR <20 char password>\n)
 										if(n < 11 || n > 30) {
-											write(sockfd, "Password must be 1-20 characters.\n", 34);
+											sendToClient(sockfd, "Password must be 1-20 characters.\n", 34);
 										}
 										else {	//Valid length command, extract the given password and compare it to the server password
 											char givenPassword[MAX_NAME_LENGTH];
@@ -625,13 +1801,15 @@ int main(int argc, char** argv) {
 											//If the given password is the same as the server password, give operator status to the user...
 											// otherwise, send an error message
 											if(strcmp(givenPassword, password) != 0) {
-												write(sockfd, "Incorrect password.\n", 20); 
+												sendToClient(sockfd, "Incorrect password.\n", 20); 
+												logEvent("ERROR", "fd=%d reason=incorrect_operator_password", sockfd);
 											}
 											else {	//If the password is correct, find this user in our data and give them operator status
 												for(int k = 0; k < allUsers.size(); k ++) {
 													if(allUsers[k].userFD == sockfd) {
 														allUsers[k].isOperator = true;
-														write(sockfd, "Operator status bestowed.\n", 26);
+														sendToClient(sockfd, "Operator status bestowed.\n", 26);
+														logEvent("OPERATOR", "fd=%d nick=%s", sockfd, nameText(allUsers[k].nameID));
 														k = allUsers.size() - 1;
 													}
 												}
@@ -656,7 +1834,7 @@ int main(int argc, char** argv) {
 								}
 
 								if(!isOperator) {
-									write(sockfd, "You are not an operator of this server.\n", 40);
+									sendToClient(sockfd, "You are not an operator of this server.\n", 40);
 								}
 								else {
 									//Get the rest of the input to be further parsed
@@ -669,7 +1847,7 @@ int main(int argc, char** argv) {
 									//A valid rest of input will have at least 4 characters (<1 char channel name> <1 char user name>\n)
 									// and at most 42 characters (<20 character channel name> <20 character user name>\n)
 									if(strlen(restOfInput) < 4 || strlen(restOfInput) > 42) {
-										write(sockfd, "Invalid KICK command: channel and user names must be 1-20 characters in length.\n", 80);
+										sendToClient(sockfd, "Invalid KICK command: channel and user names must be 1-20 characters in length.\n", 80);
 									}
 									else { //Parse the given channel name from restOfInput
 										char givenChannel[MAX_BUFFER_LENGTH]; //Give the buffer extra room in case the user gives a channel name that 
@@ -678,18 +1856,19 @@ int main(int argc, char** argv) {
 											givenChannel[j] = restOfInput[j];
 										}
 										givenChannel[j] = '\0'; //j is equal to the index directly after the last letter of the given channel name
+										int givenChannelID = lookupName(givenChannel);
 
 										//Check if the given channel name is valid
 										bool channelExists = false;
 										for(int k = 0; k < allChannels.size(); k ++) {
-											if(strcmp(allChannels[k].channelName, givenChannel) == 0) {
+											if(allChannels[k].nameID == givenChannelID) {
 												channelExists = true;
 												k = allChannels.size() - 1;
 											}
 										}
 
 										if(!channelExists) {
-											write(sockfd, "There is no channel with the name you have provided.\n", 53);
+											sendToClient(sockfd, "There is no channel with the name you have provided.\n", 53);
 										}
 										else {	//If the channel exists, get the rest of restOfInput and see if it is the name of an existing user
 											char givenName[MAX_BUFFER_LENGTH]; //Give the buffer extra room in case the user gives a user name that
@@ -698,61 +1877,68 @@ int main(int argc, char** argv) {
 												givenName[j - strlen(givenChannel) - 1] = restOfInput[j];
 											}
 											givenName[j - strlen(givenChannel) - 1] = '\0';
+											int givenID = lookupName(givenName);
 
 											//Check if the given user name is valid
 											bool userExists = false;
 											for(int k = 0; k < allUsers.size(); k ++) {
-												if(strcmp(allUsers[k].userName, givenName) == 0) {
+												if(allUsers[k].nameID == givenID) {
 													userExists = true;
 													k = allUsers.size() - 1;
 												}
 											}
 
 											if(!userExists) {
-												write(sockfd, "There is no user with the name you have provided.\n", 50);
+												sendToClient(sockfd, "There is no user with the name you have provided.\n", 50);
 											}
 											else {	//Check to see if the given user is in the given channel
 												bool userInChannel = false;
 												for(int k = 0; k < allChannels.size(); k ++) {
-													if(strcmp(allChannels[k].channelName, givenChannel) == 0) {
+													if(allChannels[k].nameID == givenChannelID) {
 														for(int l = 0; l < allChannels[k].usersInChannel.size(); l ++) {
-															if(strcmp(allChannels[k].usersInChannel[l].userName, givenName) == 0) {
+															if(allChannels[k].usersInChannel[l].nameID == givenID) {
 																userInChannel = true;
 
 																//The given user is in the channel...remove them from the channel and notify the other members
 
 																//First, notify the user being kicked
-																int mesgLen = 36 + allChannels[k].channelNameLength;
+																int mesgLen = 36 + nameLength(allChannels[k].nameID);
 																char mesg[MAX_BUFFER_LENGTH];
 																strcpy(mesg, "You have been kicked from channel ");
-																strcat(mesg, allChannels[k].channelName);
+																strcat(mesg, nameText(allChannels[k].nameID));
 																strcat(mesg, ".\n");
 
-																write(allChannels[k].usersInChannel[l].userFD, mesg, mesgLen);
+																sendToClient(allChannels[k].usersInChannel[l].userFD, mesg, mesgLen);
 
 																//Notify everyone else in the channel
 																for(int m = 0; m < allChannels[k].usersInChannel.size(); m ++) {
 																	bzero(&mesg, MAX_BUFFER_LENGTH);
-																	mesgLen = 37 + allChannels[k].channelNameLength + allChannels[k].usersInChannel[l].userNameLength;
-																	strcpy(mesg, allChannels[k].channelName);
+																	mesgLen = 37 + nameLength(allChannels[k].nameID) + nameLength(allChannels[k].usersInChannel[l].nameID);
+																	strcpy(mesg, nameText(allChannels[k].nameID));
 																	strcat(mesg, "> ");
-																	strcat(mesg, allChannels[k].usersInChannel[l].userName);
+																	strcat(mesg, nameText(allChannels[k].usersInChannel[l].nameID));
 																	strcat(mesg, " has been kicked from the channel.\n");
 
 																	//Don't send this message to the user being kicked
 																	if(m != l) {
-																		write(allChannels[k].usersInChannel[m].userFD, mesg, mesgLen);
+																		sendToClient(allChannels[k].usersInChannel[m].userFD, mesg, mesgLen);
 																	}
 																}
 
 																//Remove the user from the channel
+																forgetChannel(allChannels[k].usersInChannel[l].userFD, k);
+																logEvent("KICK", "fd=%d nick=%s channel=%s", sockfd, givenName, givenChannel);
 																allChannels[k].usersInChannel.erase(allChannels[k].usersInChannel.begin() + l);
+																chargeChannel(k, -(long) MEMBER_BYTES);
+																if(allChannels[k].usersInChannel.empty()) {
+																	emptiedChannels.push_back(k);
+																}
 															}
 														}
 													}
 												}
 												if(!userInChannel) {
-													write(sockfd, "The given user is not in the given channel.\n", 44);
+													sendToClient(sockfd, "The given user is not in the given channel.\n", 44);
 												}
 											}
 										}
@@ -768,120 +1954,211 @@ int main(int argc, char** argv) {
 								restOfInput[j - 8] = '\0';
 
 								//A valid rest of input will have at least 4 characters (<1 char channel or user name> <1 char message>\n)
-								// and at most 534 characters (<20 char channel or user name> <512 char message>\n)
-								if(strlen(restOfInput) < 4 || strlen(restOfInput) > 534) {
-									write(sockfd, "Invalid PRIVMSG command.\n", 25);
+								// and at most one full target list plus a 512 char message (<name>,<name>,... <512 char message>\n)
+								if(strlen(restOfInput) < 4 || strlen(restOfInput) > MAX_TARGET_LIST_LENGTH + MAX_MESSAGE_LENGTH + 2) {
+									sendToClient(sockfd, "Invalid PRIVMSG command.\n", 25);
 								}
-								else {	//Parse the given channel/user name from restOfInput
-									char givenName[MAX_BUFFER_LENGTH]; //Give the buffer extra room in case the user gives a name that 
-																		  // is too long
+								else {	//Split the comma-separated list of channel/user names from the message
+									char givenTargets[MAX_BUFFER_LENGTH]; //Give the buffer extra room in case the user gives names that
+																		  // are too long
 									for(j = 0; restOfInput[j] != ' ' && restOfInput[j] != '\n' && restOfInput[j] != '\0'; j ++) {
-										givenName[j] = restOfInput[j];
+										givenTargets[j] = restOfInput[j];
 									}
-									givenName[j] = '\0'; //j is equal to the index directly after the last letter of the given name
-
-									//Check to see if the given name is either a valid user name or valid channel name
-									bool validUser = false;									
-									bool validChannel = false;
+									givenTargets[j] = '\0'; //j is equal to the index directly after the last letter of the target list
 
-									for(int k = 0; k < allUsers.size(); k ++) {
-										if(strcmp(allUsers[k].userName, givenName) == 0) {
-											validUser = true;
-											k = allUsers.size() - 1;
-										}
-									}
-									if(!validUser) {
-										for(int k = 0; k < allChannels.size(); k ++) {
-											if(strcmp(allChannels[k].channelName, givenName) == 0) {
-												validChannel = true;
-												k = allChannels.size() - 1;
-											}
-										}
+									char userMesg[MAX_BUFFER_LENGTH];
+									int userMesgLength = 0;
+									for(j = j + 1; j < (int) strlen(restOfInput) - 1; j ++) {
+										userMesg[userMesgLength ++] = restOfInput[j];
 									}
+									userMesg[userMesgLength] = '\0';
 
-									if(!validUser && !validChannel) {
-										write(sockfd, "There is no user or channel with the name you have provided.\n", 61);
+									std::vector<char*> targets;
+									for(char* target = strtok(givenTargets, ","); target != NULL; target = strtok(NULL, ",")) {
+										targets.push_back(target);
 									}
-									else {	//If the message has a potential recipient, check to make sure the message is at least 1 char in length
-										char userMesg[MAX_BUFFER_LENGTH];
-
-										for(j = j + 1; j < strlen(restOfInput) - 1; j ++) {
-											userMesg[j - strlen(givenName) - 1] = restOfInput[j];
-										}
-										userMesg[j - strlen(givenName) - 1] = '\0';
 
-										if(strlen(userMesg) < 1) {
-											write(sockfd, "Messages must be at least 1 character in length.\n", 49);
+									if(targets.size() < 1 || targets.size() > MAX_PRIVMSG_TARGETS) {
+										sendToClient(sockfd, "Invalid PRIVMSG command.\n", 25);
+									}
+									else if(userMesgLength < 1) {
+										sendToClient(sockfd, "Messages must be at least 1 character in length.\n", 49);
+									}
+									else if(userMesgLength > MAX_MESSAGE_LENGTH) {
+										sendToClient(sockfd, "Messages must be at most 512 characters in length.\n", 51);
+									}
+									else {
+										//Get the sending user's info
+										int sender = 0;	//The sender is registered, so it is always found
+										for(int k = 0; k < allUsers.size(); k ++) {
+											if(allUsers[k].userFD == sockfd) {
+												sender = k;
+												k = allUsers.size() - 1;
+											}
 										}
-										else {
-											//Get the sending user's info
-											struct User sendingUser;
-											for(int k = 0; k < allUsers.size(); k ++) {
-												if(allUsers[k].userFD == sockfd) {
-													sendingUser = allUsers[k];
+										struct User& sendingUser = allUsers[sender];
+
+										//The body of the message ("<sender>: <message>\n") is the same for every target, so it is only
+										// formatted once...user targets get the body as-is, channel targets get it behind a "<channel>> " prefix
+										int bodyLen = 3 + nameLength(sendingUser.nameID) + userMesgLength;
+										char body[bodyLen + 1];	//Room for the terminator written by strcat()
+										strcpy(body, nameText(sendingUser.nameID));
+										strcat(body, ": ");
+										strcat(body, userMesg);
+										strcat(body, "\n");
+
+										//Each recipient collects every copy addressed to it so it can be sent with a single write
+										std::map<int, std::vector<struct iovec> > deliveries;
+										std::vector<int> seenUsers;
+										std::vector<int> seenChannels;
+
+										for(int t = 0; t < targets.size(); t ++) {
+											//Check to see if the given name is either a valid user name or valid channel name
+											int targetID = lookupName(targets[t]);
+											int targetUser = -1;
+											int targetChannel = -1;
+
+											for(int k = 0; targetID != -1 && k < allUsers.size(); k ++) {
+												if(allUsers[k].nameID == targetID) {
+													targetUser = k;
 													k = allUsers.size() - 1;
 												}
 											}
-
-											if(validUser) {	//If we're sending to a specific user, send the message to that user
-												if(strcmp(givenName, sendingUser.userName) == 0) {	//Do not let user send message to themselves
-													write(sockfd, "You cannot send a message to yourself.\n", 39);
-												}
-												else {
-													int mesgLen = 3 + sendingUser.userNameLength + strlen(userMesg);
-													char mesg[mesgLen];
-
-													strcpy(mesg, sendingUser.userName);
-													strcat(mesg, ": ");
-													strcat(mesg, userMesg);
-													strcat(mesg, "\n");
-
-													//Find the user and send the message
-													for(int k = 0; k < allUsers.size(); k ++) {
-														if(strcmp(givenName, allUsers[k].userName) == 0) {
-															write(allUsers[k].userFD, mesg, mesgLen);
-															k = allUsers.size() - 1;
-														}
+											if(targetID != -1 && targetUser == -1) {
+												for(int k = 0; k < allChannels.size(); k ++) {
+													if(allChannels[k].nameID == targetID) {
+														targetChannel = k;
+														k = allChannels.size() - 1;
 													}
-
 												}
 											}
-											else {	//We're sending this message to a whole channel
-												int mesgLen = 5 + strlen(givenName) + sendingUser.userNameLength + strlen(userMesg);
-												char mesg[mesgLen];
 
-												strcpy(mesg, givenName);
-												strcat(mesg, "> ");
-												strcat(mesg, sendingUser.userName);
-												strcat(mesg, ": ");
-												strcat(mesg, userMesg);
-												strcat(mesg, "\n");
+											if(targetUser == -1 && targetChannel == -1) {
+												sendToClient(sockfd, "There is no user or channel with the name you have provided.\n", 61);
+											}
+											else if(targetUser != -1) {	//If we're sending to a specific user, queue the body for that user
+												if(allUsers[targetUser].userFD == sockfd) {	//Do not let user send message to themselves
+													sendToClient(sockfd, "You cannot send a message to yourself.\n", 39);
+												}
+												else if(std::find(seenUsers.begin(), seenUsers.end(), targetUser) == seenUsers.end()) {
+													seenUsers.push_back(targetUser);
 
-												for(int k = 0; k < allChannels.size(); k ++) {
-													if(strcmp(allChannels[k].channelName, givenName) == 0) {
-														for(int l = 0; l < allChannels[k].usersInChannel.size(); l ++) {
-															write(allChannels[k].usersInChannel[l].userFD, mesg, mesgLen);
-														}
-													}
+													struct iovec bodyVec = {body, (size_t) bodyLen};
+													deliveries[allUsers[targetUser].userFD].push_back(bodyVec);
 												}
 											}
-										}									
+											else if(std::find(seenChannels.begin(), seenChannels.end(), targetChannel) == seenChannels.end()) {
+												//We're sending this message to a whole channel, queue the prefixed body for every member
+												seenChannels.push_back(targetChannel);
+
+												struct iovec channelVec = {(void*) nameText(allChannels[targetChannel].nameID), (size_t) nameLength(allChannels[targetChannel].nameID)};
+												struct iovec separatorVec = {(void*) "> ", 2};
+												struct iovec bodyVec = {body, (size_t) bodyLen};
+
+												for(int l = 0; l < allChannels[targetChannel].usersInChannel.size(); l ++) {
+													std::vector<struct iovec>& pending = deliveries[allChannels[targetChannel].usersInChannel[l].userFD];
+													pending.push_back(channelVec);
+													pending.push_back(separatorVec);
+													pending.push_back(bodyVec);
+												}
+											}
+										}
+
+										for(std::map<int, std::vector<struct iovec> >::iterator it = deliveries.begin(); it != deliveries.end(); it ++) {
+											sendVectorToClient(it->first, &it->second[0], it->second.size());
+										}
+									}
+								}
+							}
+							else if(strcmp(firstWord, "STATS") == 0) {
+								char mesg[MAX_BUFFER_LENGTH];
+								int mesgLen;
+								if(j == n - 1) {	//If the input was simply "STATS\n", report the memory used by all connections and channels
+									mesgLen = sprintf(mesg, "Memory in use: %zu bytes", connectionMemoryInUse + channelMemoryInUse);
+									if(memoryLimit != 0) {
+										mesgLen += sprintf(mesg + mesgLen, " of %zu", memoryLimit);
+									}
+									mesgLen += sprintf(mesg + mesgLen, "\n* %d connection(s) using %zu bytes\n* %d channel(s) using %zu bytes\n",
+										(int) connectionMemory.size(), connectionMemoryInUse, (int) allChannels.size(), channelMemoryInUse);
+									sendToClient(sockfd, mesg, mesgLen);
+								}
+								else if(n > 27 || buf[j] != ' ') {	//A valid STATS command will have length no more than 27 (STATS <20 char name>\n)
+									sendToClient(sockfd, "Malformed STATS command - Usage: STATS [<nickname or #channel>]\n", 64);
+								}
+								else {	//Report the memory attributed to the given user's connection or to the given channel
+									char givenName[MAX_NAME_LENGTH];
+									for(j = 6; j < n - 1; j ++) {
+										givenName[j - 6] = buf[j];
+									}
+									givenName[j - 6] = '\0';
+									int givenID = lookupName(givenName);
+
+									mesgLen = 0;
+									for(int k = 0; k < allChannels.size() && givenID != -1 && mesgLen == 0; k ++) {
+										if(allChannels[k].nameID == givenID) {
+											mesgLen = sprintf(mesg, "%s is using %zu bytes for %d member(s).\n", givenName, allChannels[k].memory, (int) allChannels[k].usersInChannel.size());
+										}
+									}
+									for(int k = 0; k < allUsers.size() && givenID != -1 && mesgLen == 0; k ++) {
+										if(allUsers[k].nameID == givenID) {
+											std::map<int, std::vector<int> >::iterator joined = channelsOfUser.find(allUsers[k].userFD);
+											int numChannels = joined == channelsOfUser.end() ? 0 : joined->second.size();
+											mesgLen = sprintf(mesg, "%s is using %zu bytes across %d channel(s).\n", givenName, connectionMemory[allUsers[k].userFD], numChannels);
+										}
+									}
+
+									if(mesgLen == 0) {
+										sendToClient(sockfd, "There is no user or channel with the name you have given.\n", 58);
+									}
+									else {
+										sendToClient(sockfd, mesg, mesgLen);
+									}
+								}
+							}
+							else if(strcmp(firstWord, "TRACE") == 0) {
+								//Only operators may write the trace, since it goes to a file on the server
+								bool isOperator = false;
+								for(int k = 0; k < allUsers.size(); k ++) {
+									if(allUsers[k].userFD == sockfd) {
+										isOperator = allUsers[k].isOperator;
+										k = allUsers.size() - 1;
 									}
 								}
+
+								if(!isOperator) {
+									sendToClient(sockfd, "You are not an operator of this server.\n", 40);
+								}
+#ifdef IRC_TRACING
+								else if(traceFileName == NULL) {
+									sendToClient(sockfd, "Tracing is not enabled, start the server with --trace=<file>.\n", 62);
+								}
+								else if(!dumpTrace()) {
+									sendToClient(sockfd, "The trace could not be written.\n", 32);
+								}
+								else {
+									char mesg[MAX_BUFFER_LENGTH];
+									int mesgLen = snprintf(mesg, sizeof(mesg), "Trace written to %s.\n", traceFileName);
+									sendToClient(sockfd, mesg, std::min(mesgLen, (int) sizeof(mesg) - 1));
+								}
+#else
+								else {
+									sendToClient(sockfd, "This server was built without tracing.\n", 39);
+								}
+#endif
 							}
 							else if(strcmp(firstWord, "QUIT") == 0) {
 								if(j == n - 1) {	//We've received a correctly formed QUIT command ("QUIT\n")
-									removeInstances(sockfd);
-									close(sockfd);
+									logEvent("QUIT", "fd=%d", sockfd);
+									disconnectedFDs.push_back(sockfd);
 									FD_CLR(sockfd, &allset);
 									allClients[i] = -1;								
 								}
 								else {	//Malformed command, send error message
-									write(sockfd, "Malformed QUIT command - Usage: QUIT\n", 37);
+									sendToClient(sockfd, "Malformed QUIT command - Usage: QUIT\n", 37);
 								}
 							}
 							else {	//Invalid command
-								write(sockfd, "Invalid command.\n", 17);
+								sendToClient(sockfd, "Invalid command.\n", 17);
 							}
 						}
 					}
@@ -893,5 +2170,10 @@ int main(int argc, char** argv) {
 					break;
 			}
 		}
+
+		//Remove everyone who left during this pass together, so a channel several of them shared is updated once, then
+		// tear down the channels nobody is left in
+		removeInstances(disconnectedFDs);
+		removeEmptyChannels(emptiedChannels);
 	}
 }
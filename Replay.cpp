@@ -0,0 +1,428 @@
+//Replays traffic recorded with the server's --capture option and measures how the server keeps up
+//
+//Usage: <executable> [--fast] <capture file> <server> [<second server>]
+//
+//A server is given as "<port>", "<host>:<port>" or "unix:<path>", where a path starting with '@' names a socket in the
+// abstract namespace.
+//
+//Each captured connection is opened again and its inbound bytes are resent, either at the pace they were captured
+// or, with --fast, as soon as possible. Since the server handles one command per read(), a command is held back until
+// the previously sent command has been answered and the server has gone quiet for QUIET_MICROS (for at most
+// SETTLE_MICROS in all). That way two commands never arrive in a single read, commands from different connections
+// reach the server in the captured order, and the first bytes a connection receives after a command are its reply.
+//
+//Because of that hold, wall clock time mostly measures the replay itself. Throughput is instead reported against
+// server time, the time from sending each command to the last bytes received before the next one is sent, which
+// leaves out the quiet windows and (without --fast) the gaps between captured commands.
+//
+//When a second server is given the capture is replayed against each server in turn and the difference between the
+// two runs is reported, which makes it easy to compare two builds on the same trace.
+
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include "Capture.h"
+
+const long long SETTLE_MICROS = 2000;		//Longest a command is held back waiting for the previous one to finish
+const long long QUIET_MICROS = 200;			//Time without output after which the server is taken to be done with a command
+const long long DRAIN_MICROS = 500000;		//Quiet time after the last record before a run is considered finished
+const int MAX_READ_LENGTH = 65536;
+
+//A record of the capture together with its data
+struct Record {
+	struct CaptureRecord header;
+	std::vector<char> data;
+};
+
+//A captured connection that is being replayed
+struct ReplayConnection {
+	int fd;
+	long long sentAt;		//When the last command was sent
+	bool awaitingReply;		//True until the first bytes after the last command arrive
+};
+
+//Measurements of one replay
+struct ReplayResult {
+	long long elapsed;			//Microseconds from the first record to the last byte sent or received
+	long long serverTime;		//Microseconds spent answering commands, see the top of this file
+	long long commandsSent;
+	long long bytesSent;
+	long long bytesReceived;
+	std::vector<long long> latencies;	//Microseconds from sending a command to the first bytes received after it
+};
+
+//This function returns the current time of the monotonic clock in microseconds
+long long nowMicros() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+//This function reads every record of the capture in fileName into records, counting the records the server reported
+// as dropped in dropped...it returns false if the file is not a complete capture
+bool loadCapture(const char* fileName, std::vector<Record>& records, unsigned long& dropped) {
+	FILE* file = fopen(fileName, "rb");
+	if(file == NULL) {
+		perror("fopen() error");
+		return false;
+	}
+
+	char magic[sizeof(CAPTURE_MAGIC)];
+	if(fread(magic, 1, sizeof(magic), file) != sizeof(magic) || memcmp(magic, CAPTURE_MAGIC, sizeof(magic)) != 0) {
+		printf("%s is not a traffic capture.\n", fileName);
+		fclose(file);
+		return false;
+	}
+
+	dropped = 0;
+	struct Record record;
+	while(fread(&record.header, sizeof(record.header), 1, file) == 1) {
+		record.data.resize(record.header.length);
+		if(record.header.length > 0 && fread(&record.data[0], 1, record.header.length, file) != record.header.length) {
+			break;	//The server was stopped in the middle of writing this record
+		}
+
+		if(record.header.type == CAPTURE_DROPPED) {
+			dropped += record.header.connection;
+		}
+		else {
+			records.push_back(record);
+		}
+	}
+
+	fclose(file);
+	return true;
+}
+
+//This function connects to the Unix domain socket at path ('@' for the abstract namespace), returning the socket or
+// -1 on failure
+int connectToUnix(const char* path) {
+	struct sockaddr_un unaddr;
+	bzero(&unaddr, sizeof(unaddr));
+	unaddr.sun_family = AF_UNIX;
+	if(strlen(path) < 1 || strlen(path) >= sizeof(unaddr.sun_path)) {
+		return -1;
+	}
+
+	socklen_t addrLen = sizeof(unaddr);
+	if(path[0] == '@') {
+		memcpy(unaddr.sun_path + 1, path + 1, strlen(path) - 1);
+		addrLen = offsetof(struct sockaddr_un, sun_path) + strlen(path);
+	}
+	else {
+		strcpy(unaddr.sun_path, path);
+	}
+
+	int sockfd;
+	if((sockfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		return -1;
+	}
+	if(connect(sockfd, (struct sockaddr*) &unaddr, addrLen) < 0) {
+		close(sockfd);
+		return -1;
+	}
+	return sockfd;
+}
+
+//This function connects to target ("<port>", "<host>:<port>" or "unix:<path>"), returning the socket or -1 on failure
+int connectTo(const char* target) {
+	if(strncmp(target, "unix:", 5) == 0) {
+		return connectToUnix(target + 5);
+	}
+
+	char host[256] = "127.0.0.1";
+	const char* port = target;
+	const char* colon = strrchr(target, ':');
+	if(colon != NULL) {
+		snprintf(host, sizeof(host), "%.*s", (int) (colon - target), target);
+		port = colon + 1;
+	}
+
+	struct addrinfo hints;
+	struct addrinfo* addresses;
+	bzero(&hints, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if(getaddrinfo(host, port, &hints, &addresses) != 0) {
+		return -1;
+	}
+
+	int sockfd = -1;
+	for(struct addrinfo* address = addresses; address != NULL && sockfd < 0; address = address->ai_next) {
+		if((sockfd = socket(address->ai_family, address->ai_socktype, address->ai_protocol)) < 0) {
+			continue;
+		}
+		if(connect(sockfd, address->ai_addr, address->ai_addrlen) < 0) {
+			close(sockfd);
+			sockfd = -1;
+		}
+	}
+	freeaddrinfo(addresses);
+
+	if(sockfd >= 0) {	//Commands are small and latency is what we measure, so send them right away
+		int on = 1;
+		setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	}
+	return sockfd;
+}
+
+//This function waits up to timeoutMicros for data on the open connections, recording the latency of the first reply
+// to each command...it returns the number of bytes received
+long long pumpReplies(std::map<uint32_t, ReplayConnection>& connections, long long timeoutMicros, struct ReplayResult& result, long long& lastActivity) {
+	std::vector<struct pollfd> pollfds;
+	std::vector<uint32_t> pollConnections;
+	for(std::map<uint32_t, ReplayConnection>::iterator it = connections.begin(); it != connections.end(); it ++) {
+		if(it->second.fd >= 0) {
+			struct pollfd pfd = {it->second.fd, POLLIN, 0};
+			pollfds.push_back(pfd);
+			pollConnections.push_back(it->first);
+		}
+	}
+
+	struct timespec timeout = {(time_t) (timeoutMicros / 1000000), (long) (timeoutMicros % 1000000) * 1000};
+	if(ppoll(pollfds.empty() ? NULL : &pollfds[0], pollfds.size(), &timeout, NULL) <= 0) {
+		return 0;
+	}
+
+	long long received = 0;
+	char buf[MAX_READ_LENGTH];
+	for(int i = 0; i < pollfds.size(); i ++) {
+		if(pollfds[i].revents == 0) {
+			continue;
+		}
+
+		struct ReplayConnection& connection = connections[pollConnections[i]];
+		ssize_t n = recv(connection.fd, buf, sizeof(buf), 0);
+		if(n <= 0) {	//The server closed the connection (e.g. after QUIT or an invalid USER)
+			close(connection.fd);
+			connection.fd = -1;
+			continue;
+		}
+
+		long long now = nowMicros();
+		if(connection.awaitingReply) {
+			result.latencies.push_back(now - connection.sentAt);
+			connection.awaitingReply = false;
+		}
+		received += n;
+		lastActivity = now;
+	}
+
+	result.bytesReceived += received;
+	return received;
+}
+
+//This function replays records against target, at the captured pace unless fast is set
+struct ReplayResult replay(const std::vector<Record>& records, const char* target, bool fast) {
+	struct ReplayResult result;
+	result.commandsSent = 0;
+	result.bytesSent = 0;
+	result.bytesReceived = 0;
+	result.serverTime = 0;
+
+	std::map<uint32_t, ReplayConnection> connections;
+	uint32_t lastConnection = 0;	//Connection the previous command was sent on
+	long long lastSentAt = -1;		//When the previous command was sent
+	long long start = nowMicros();
+	long long lastActivity = start;
+
+	for(int i = 0; i < records.size(); i ++) {
+		const struct CaptureRecord& header = records[i].header;
+
+		//Wait until the record is due, handling replies in the meantime
+		if(!fast) {
+			long long due = start + header.timestamp;
+			for(long long now = nowMicros(); now < due; now = nowMicros()) {
+				pumpReplies(connections, due - now, result, lastActivity);
+			}
+		}
+		else {
+			pumpReplies(connections, 0, result, lastActivity);
+		}
+
+		if(header.type == CAPTURE_CONNECT) {
+			struct ReplayConnection connection;
+			if((connection.fd = connectTo(target)) < 0) {
+				printf("Could not connect to %s.\n", target);
+				exit(-1);
+			}
+			connection.sentAt = 0;
+			connection.awaitingReply = false;
+			connections[header.connection] = connection;
+		}
+		else if(header.type == CAPTURE_DATA) {
+			if(connections.count(header.connection) == 0 || connections[header.connection].fd < 0) {
+				continue;	//The connection was captured part way through, or the server has already closed it
+			}
+
+			//Hold the command back until the previous command has been answered and the server has gone quiet
+			long long heldSince = nowMicros();
+			for(long long now = heldSince; now - heldSince < SETTLE_MICROS; now = nowMicros()) {
+				bool awaitingPrevious = connections.count(lastConnection) != 0 && connections[lastConnection].awaitingReply;
+				long long wait = awaitingPrevious ? SETTLE_MICROS - (now - heldSince) : std::min(QUIET_MICROS, SETTLE_MICROS - (now - heldSince));
+				if(pumpReplies(connections, wait, result, lastActivity) == 0 && !awaitingPrevious) {
+					break;
+				}
+			}
+
+			struct ReplayConnection& connection = connections[header.connection];
+			if(connection.fd < 0) {
+				continue;
+			}
+
+			//The server was busy with the previous command until the last bytes it sent before this one
+			if(lastSentAt >= 0) {
+				result.serverTime += lastActivity - lastSentAt;
+			}
+
+			for(int sent = 0; sent < records[i].data.size(); ) {
+				ssize_t n = send(connection.fd, &records[i].data[sent], records[i].data.size() - sent, MSG_NOSIGNAL);
+				if(n <= 0) {
+					break;
+				}
+				sent += n;
+			}
+
+			connection.sentAt = lastActivity = lastSentAt = nowMicros();
+			connection.awaitingReply = true;
+			lastConnection = header.connection;
+			result.commandsSent ++;
+			result.bytesSent += records[i].data.size();
+		}
+		else if(header.type == CAPTURE_CLOSE) {
+			if(connections.count(header.connection) != 0) {
+				if(connections[header.connection].fd >= 0) {
+					close(connections[header.connection].fd);
+				}
+				connections.erase(header.connection);
+			}
+		}
+	}
+
+	//Collect the remaining replies until the server goes quiet
+	while(pumpReplies(connections, DRAIN_MICROS, result, lastActivity) > 0) {
+	}
+	if(lastSentAt >= 0) {
+		result.serverTime += lastActivity - lastSentAt;
+	}
+
+	for(std::map<uint32_t, ReplayConnection>::iterator it = connections.begin(); it != connections.end(); it ++) {
+		if(it->second.fd >= 0) {
+			close(it->second.fd);
+		}
+	}
+
+	result.elapsed = std::max(lastActivity - start, 1LL);
+	std::sort(result.latencies.begin(), result.latencies.end());
+	return result;
+}
+
+//This function returns the given percentile of the sorted latencies, or 0 if there are none
+long long percentile(const std::vector<long long>& latencies, double fraction) {
+	if(latencies.empty()) {
+		return 0;
+	}
+	return latencies[std::min((size_t) (fraction * latencies.size()), latencies.size() - 1)];
+}
+
+//This function returns the average of latencies, or 0 if there are none
+double mean(const std::vector<long long>& latencies) {
+	if(latencies.empty()) {
+		return 0;
+	}
+	double total = 0;
+	for(int i = 0; i < latencies.size(); i ++) {
+		total += latencies[i];
+	}
+	return total / latencies.size();
+}
+
+//This function returns the number of commands answered per second of server time during result
+double throughput(const struct ReplayResult& result) {
+	return result.commandsSent * 1000000.0 / std::max(result.serverTime, 1LL);
+}
+
+//This function prints the measurements of a replay against target
+void printResult(const char* target, const struct ReplayResult& result) {
+	printf("%s:\n", target);
+	printf("  elapsed:        %.3f s\n", result.elapsed / 1000000.0);
+	printf("  server time:    %.3f s\n", result.serverTime / 1000000.0);
+	printf("  commands sent:  %lld (%.1f/s of server time)\n", result.commandsSent, throughput(result));
+	printf("  bytes sent:     %lld\n", result.bytesSent);
+	printf("  bytes received: %lld\n", result.bytesReceived);
+	printf("  replies:        %d\n", (int) result.latencies.size());
+	printf("  latency (us):   mean %.1f, p50 %lld, p99 %lld, max %lld\n", mean(result.latencies),
+		percentile(result.latencies, 0.5), percentile(result.latencies, 0.99), percentile(result.latencies, 1.0));
+}
+
+//This function prints how much second differs from first as a percentage
+void printChange(const char* name, double first, double second) {
+	if(first == 0) {
+		printf("  %-15s n/a\n", name);
+	}
+	else {
+		printf("  %-15s %+.1f%%\n", name, (second - first) * 100.0 / first);
+	}
+}
+
+int main(int argc, char** argv) {
+	bool fast = false;
+	int option_index = 0;
+	int opt;
+	static struct option long_options[] = {
+		{"fast", no_argument, 0, 'f'},
+		{0, 0, 0, 0}
+	};
+
+	while((opt = getopt_long(argc, argv, "", long_options, &option_index)) != -1) {
+		if(opt == '?') {
+			exit(-1);
+		}
+		else if(opt == 'f') {
+			fast = true;
+		}
+	}
+	if(argc - optind < 2 || argc - optind > 3) {
+		printf("Usage: <executable> [--fast] <capture file> <port, host:port or unix:path> [<second server>]\n");
+		exit(-1);
+	}
+
+	std::vector<Record> records;
+	unsigned long dropped;
+	if(!loadCapture(argv[optind], records, dropped)) {
+		exit(-1);
+	}
+	printf("Replaying %d records from %s%s.\n", (int) records.size(), argv[optind], fast ? " as fast as possible" : "");
+	if(dropped > 0) {
+		printf("Warning: the server dropped %lu records while capturing, the replay may not match the original traffic.\n", dropped);
+	}
+
+	struct ReplayResult first = replay(records, argv[optind + 1], fast);
+	printResult(argv[optind + 1], first);
+
+	if(argc - optind == 3) {
+		struct ReplayResult second = replay(records, argv[optind + 2], fast);
+		printResult(argv[optind + 2], second);
+
+		printf("Change from %s to %s:\n", argv[optind + 1], argv[optind + 2]);
+		printChange("throughput", throughput(first), throughput(second));
+		printChange("mean latency", mean(first.latencies), mean(second.latencies));
+		printChange("p50 latency", percentile(first.latencies, 0.5), percentile(second.latencies, 0.5));
+		printChange("p99 latency", percentile(first.latencies, 0.99), percentile(second.latencies, 0.99));
+	}
+}